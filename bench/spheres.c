@@ -0,0 +1,171 @@
+// Sphere kernel benchmark. Brute forces rays against 1k, 100k and 1M
+// random spheres (or just the given count), through intersect_object
+// (the old one at a time path) and through every nearest_sphere kernel
+// this machine can run. The SIMD kernels have to pick the exact same
+// sphere as the scalar one. The old path gets its own count of rays it
+// doesn't agree on: those are grazing hits on small spheres far away,
+// where c (|orig - center|^2 - r^2) loses most of its bits in float,
+// and either one can end up on the wrong side
+//
+// Usage: bench_spheres [spheres]
+
+// The kernels are static, so this needs raytracer.c itself
+#include "raytracer.c"
+
+// Every size gets about this many ray-sphere tests
+#define BENCH_TESTS                 50000000
+
+enum bench_kernel_t
+{
+    BENCH_OLD,
+    BENCH_SCALAR,
+    BENCH_SSE,
+    BENCH_AVX,
+    BENCH_KERNELS
+};
+
+static const char *
+KERNEL_NAMES[BENCH_KERNELS] = {"old path", "scalar", "sse", "avx"};
+
+static float
+random_float(void)
+{
+    return rand()/(float)RAND_MAX;
+}
+
+static bool
+has_kernel(enum bench_kernel_t k)
+{
+#ifdef RAYTRACER_X86_SIMD
+    if(k == BENCH_AVX)
+        return __builtin_cpu_supports("avx");
+    return true;
+#else
+    return k == BENCH_OLD || k == BENCH_SCALAR;
+#endif
+}
+
+// Index of the nearest of the count spheres ray hits, with kernel
+// k (UINT32_MAX if there's none). Saves how far it is on t
+static uint32_t
+nearest(enum bench_kernel_t k, struct ray_t *ray, struct gobject_t *objects, struct sphere_list_t *l, uint32_t count, float *t)
+{
+    struct hit_t hit = {UINT32_MAX};
+
+    switch(k)
+    {
+        case BENCH_OLD:
+            *t = INFINITY;
+            for(uint32_t i = 0; i < count; i++)
+                intersect_object(ray, &objects[i], i, t, &hit);
+            return hit.ref == UINT32_MAX ? UINT32_MAX : hit.ref & SCENE_REF_INDEX;
+#ifdef RAYTRACER_X86_SIMD
+        case BENCH_SSE:
+            return nearest_sphere_sse(ray, l, 0, count, INFINITY, t);
+        case BENCH_AVX:
+            return nearest_sphere_avx(ray, l, 0, count, INFINITY, t);
+#endif
+        default:
+            return nearest_sphere_scalar(ray, l, 0, count, INFINITY, t);
+    }
+}
+
+// Returns how many rays the SIMD kernels didn't agree with the scalar one on
+static size_t
+run(uint32_t count)
+{
+    struct gobject_t *objects = (struct gobject_t *)malloc(count * sizeof(struct gobject_t));
+    struct sphere_list_t l = {0};
+    struct ray_t *rays = NULL;
+    struct pv_t center, orig = PV(0.0, 0.0, 0.0), dir;
+    uint32_t *expected = NULL, hit = 0;
+    size_t ray_count = BENCH_TESTS / count, hits = 0, mismatches = 0, differ = 0;
+    double start = 0.0, ms = 0.0;
+    float radius = 0.0f, t = 0.0f, *expected_t = NULL;
+
+    if(ray_count == 0)
+        ray_count = 1;
+
+    l.cx = (float *)malloc(count * sizeof(float));
+    l.cy = (float *)malloc(count * sizeof(float));
+    l.cz = (float *)malloc(count * sizeof(float));
+    l.radius2 = (float *)malloc(count * sizeof(float));
+    l.count = count;
+    rays = (struct ray_t *)malloc(ray_count * sizeof(struct ray_t));
+    expected = (uint32_t *)malloc(ray_count * sizeof(uint32_t));
+    expected_t = (float *)malloc(ray_count * sizeof(float));
+
+    srand(1);
+    for(uint32_t i = 0; i < count; i++)
+    {
+        center = PV(random_float() * 20.0f - 10.0f, random_float() * 20.0f - 10.0f, -random_float() * 40.0f - 1.0f);
+        radius = 0.01f + random_float() * 0.05f;
+        make_sphere(&center, radius, &objects[i]);
+
+        l.cx[i] = center.x;
+        l.cy[i] = center.y;
+        l.cz[i] = center.z;
+        l.radius2[i] = objects[i].radius2;
+    }
+
+    for(size_t i = 0; i < ray_count; i++)
+    {
+        dir = PV(random_float() - 0.5f, random_float() - 0.5f, -1.0f);
+        make_ray(&orig, &dir, &rays[i]);
+    }
+
+    for(size_t i = 0; i < ray_count; i++)
+    {
+        expected[i] = nearest(BENCH_SCALAR, &rays[i], objects, &l, count, &expected_t[i]);
+        hits += expected[i] != UINT32_MAX;
+    }
+    inf("%u spheres, %zu rays (%zu hit something)", count, ray_count, hits);
+
+    for(int k = 0; k < BENCH_KERNELS; k++)
+    {
+        if(!has_kernel(k))
+            continue;
+
+        differ = 0;
+        start = time_ms();
+        for(size_t i = 0; i < ray_count; i++)
+        {
+            hit = nearest(k, &rays[i], objects, &l, count, &t);
+            differ += hit != expected[i];
+        }
+        ms = time_ms() - start;
+
+        inf("    %-10s %6.2f ns/test (%zu rays differ)", KERNEL_NAMES[k], ms * 1e6 / ((double)ray_count * count), differ);
+        if(k != BENCH_OLD)
+            mismatches += differ;
+    }
+
+    if(mismatches > 0)
+        err("simd kernels picked a different sphere than the scalar one on %zu rays", mismatches);
+
+    free(objects);
+    free(l.cx);
+    free(l.cy);
+    free(l.cz);
+    free(l.radius2);
+    free(rays);
+    free(expected);
+    free(expected_t);
+
+    return mismatches;
+}
+
+int
+main(int argc, char const *argv[])
+{
+    uint32_t sizes[] = {1000, 100000, 1000000};
+    size_t mismatches = 0;
+
+    if(argc > 1)
+        return run(atol(argv[1])) > 0;
+
+    for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++)
+        mismatches += run(sizes[i]);
+
+    return mismatches > 0;
+}
@@ -0,0 +1,175 @@
+// Triangle kernel benchmark. Shoots a bunch of rays at a soup of
+// small random triangles, and times intersect_object (Moller-Trumbore,
+// see intersect_triangle) against the plane + inside out test it
+// replaced, which is kept below. Both have to agree on the closest hit
+//
+// Usage: bench_triangle [triangles] [rays]
+
+// The kernels are static, so this needs raytracer.c itself
+#include "raytracer.c"
+
+#define BENCH_TRIANGLES             4096
+#define BENCH_RAYS                  2000
+#define BENCH_RUNS                  3
+
+// The old GEOMETRY_TRIANGLE case of ray_intersect: hits the plane of
+// the triangle first, then checks the hit is on the inner side of
+// every edge. Fills info on every hit, closest or not
+static float
+old_intersect_triangle(struct ray_t *ray, struct gobject_t *object, struct hit_info_t *info)
+{
+    struct pv_t pv, p, c;
+    float normal_dot_dir = 0.0, t0 = -1.0;
+
+    normal_dot_dir = dot_product(&object->normal, &ray->dir);
+    if(fabs(normal_dot_dir) < SMALL_F)
+        return -1.0;
+    if(normal_dot_dir > 0.0 && object->single_sided)
+        return -1.0;
+
+    t0 = (-dot_product(&object->normal, &ray->orig) + dot_product(&object->normal, &object->edges[0])) / normal_dot_dir;
+    if(t0 < 0.0)
+        return t0;
+
+    ray_intersect_point(ray, t0, &pv);
+
+    substract_pv(&pv, &object->edges[0], &p);
+    cross_pv(&object->ba, &p, &c);
+    if(dot_product(&c, &object->normal) < 0)
+        return -1.0;
+
+    substract_pv(&pv, &object->edges[1], &p);
+    cross_pv(&object->cb, &p, &c);
+    if((info->u = dot_product(&c, &object->normal)) < 0)
+        return -1.0;
+
+    substract_pv(&pv, &object->edges[2], &p);
+    cross_pv(&object->ac, &p, &c);
+    if((info->v = dot_product(&c, &object->normal)) < 0)
+        return -1.0;
+
+    info->u /= object->area;
+    info->v /= object->area;
+    info->w = 1 - info->u - info->v;
+    info->normal = object->normal;
+    info->object = object;
+    ray_intersect_point(ray, t0, &info->hit_point);
+
+    return t0;
+}
+
+static float
+random_float(void)
+{
+    return rand()/(float)RAND_MAX * 2.0f - 1.0f;
+}
+
+// Closest of the count triangles ray hits with the old test
+static size_t
+old_closest(struct ray_t *ray, struct gobject_t *triangles, size_t count, float *t, struct hit_info_t *info)
+{
+    struct hit_info_t current;
+    size_t closest = count;
+    float ct = 0.0;
+
+    *t = INFINITY;
+    for(size_t i = 0; i < count; i++)
+    {
+        ct = old_intersect_triangle(ray, &triangles[i], &current);
+        if(ct > 0.0 && ct < *t)
+        {
+            *t = ct;
+            *info = current;
+            closest = i;
+        }
+    }
+
+    return closest;
+}
+
+// Same with the new one
+static size_t
+new_closest(struct ray_t *ray, struct gobject_t *triangles, size_t count, float *t)
+{
+    struct hit_t hit = {UINT32_MAX};
+
+    *t = INFINITY;
+    for(size_t i = 0; i < count; i++)
+        intersect_object(ray, &triangles[i], i, t, &hit);
+
+    return hit.ref == UINT32_MAX ? count : hit.ref & SCENE_REF_INDEX;
+}
+
+int
+main(int argc, char const *argv[])
+{
+    size_t count = BENCH_TRIANGLES, ray_count = BENCH_RAYS, agree = 0, hits = 0, closest = 0;
+    struct gobject_t *triangles = NULL;
+    struct ray_t *rays = NULL;
+    struct hit_info_t info;
+    struct pv_t a, b, c, orig = PV(0.0, 0.0, 0.0), dir;
+    double start = 0.0, old_ms = 0.0, new_ms = 0.0;
+    volatile float sink = 0.0f;
+    float t = 0.0f;
+
+    if(argc > 1)
+        count = atol(argv[1]);
+    if(argc > 2)
+        ray_count = atol(argv[2]);
+
+    triangles = (struct gobject_t *)calloc(count, sizeof(struct gobject_t));
+    rays = (struct ray_t *)calloc(ray_count, sizeof(struct ray_t));
+
+    srand(1);
+    for(size_t i = 0; i < count; i++)
+    {
+        a = PV(random_float(), random_float(), random_float() - 3.0f);
+        b = PV(a.x + random_float() * 0.3f, a.y + random_float() * 0.3f, a.z + random_float() * 0.3f);
+        c = PV(a.x + random_float() * 0.3f, a.y + random_float() * 0.3f, a.z + random_float() * 0.3f);
+        make_triangle(&a, &b, &c, &triangles[i]);
+        triangles[i].single_sided = false;
+    }
+
+    for(size_t i = 0; i < ray_count; i++)
+    {
+        dir = PV(random_float() * 0.4f, random_float() * 0.4f, -1.0f);
+        make_ray(&orig, &dir, &rays[i]);
+    }
+
+    for(size_t i = 0; i < ray_count; i++)
+    {
+        closest = old_closest(&rays[i], triangles, count, &t, &info);
+        hits += closest < count;
+        agree += closest == new_closest(&rays[i], triangles, count, &t);
+    }
+    inf("%zu triangles, %zu rays (%zu hit something)", count, ray_count, hits);
+    inf("closest hit agreement: %zu out of %zu", agree, ray_count);
+
+    for(int run = 0; run < BENCH_RUNS; run++)
+    {
+        start = time_ms();
+        for(size_t i = 0; i < ray_count; i++)
+        {
+            old_closest(&rays[i], triangles, count, &t, &info);
+            sink += t;
+        }
+        old_ms = time_ms() - start;
+
+        start = time_ms();
+        for(size_t i = 0; i < ray_count; i++)
+        {
+            new_closest(&rays[i], triangles, count, &t);
+            sink += t;
+        }
+        new_ms = time_ms() - start;
+
+        inf("old %.1f ns/test, new %.1f ns/test (%.2fx)",
+                old_ms * 1e6 / ((double)count * ray_count),
+                new_ms * 1e6 / ((double)count * ray_count), old_ms / new_ms);
+    }
+
+    free(triangles);
+    free(rays);
+
+    return agree == ray_count ? 0 : 1;
+}
@@ -0,0 +1,1074 @@
+#include <math.h>
+#include <float.h>
+#include <string.h>
+
+#include <stdatomic.h>
+
+#include "bvh.h"
+#include "geometry.h"
+#include "utilities.h"
+
+// Only x86 gets the SSE/AVX node tests for now, everyone
+// else (or anyone building with BVH_NO_SIMD) gets the
+// scalar one
+#if !defined(BVH_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BVH_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Centroids right on the upper bound would land one past the last bin
+#define MIN_BIN(b)                  ((b) < BVH_BINS - 1 ? (b) : BVH_BINS - 1)
+
+struct bvh_bin_t
+{
+    struct aabb_t bounds;
+    size_t count;
+};
+
+// Everything the builder needs to carry around while recursing
+struct bvh_builder_t
+{
+    struct bvh_t *bvh;
+    const struct aabb_t *boxes;
+    float (*centroids)[3];
+
+    // Next free node
+    atomic_size_t node_count;
+};
+
+// A chunk of the primitives of a node, to be bounded or binned
+// by a single thread
+struct bvh_range_t
+{
+    struct bvh_builder_t *b;
+    size_t first, count;
+
+    struct aabb_t bounds, centroid_bounds;
+    struct bvh_bin_t bins[3][BVH_BINS];
+};
+
+// A subtree that might get built by another thread
+struct bvh_task_t
+{
+    struct bvh_builder_t *b;
+    uint32_t node;
+    size_t first, count;
+    int depth;
+};
+
+// Pool bvhs get built on, if any
+static struct pool_t *build_pool = NULL;
+
+void
+aabb_empty(struct aabb_t *b)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        b->min[i] = INFINITY;
+        b->max[i] = -INFINITY;
+    }
+}
+
+void
+aabb_grow(struct aabb_t *b, const float p[3])
+{
+    for(int i = 0; i < 3; i++)
+    {
+        b->min[i] = fminf(b->min[i], p[i]);
+        b->max[i] = fmaxf(b->max[i], p[i]);
+    }
+}
+
+void
+aabb_merge(struct aabb_t *b, const struct aabb_t *o)
+{
+    for(int i = 0; i < 3; i++)
+    {
+        b->min[i] = fminf(b->min[i], o->min[i]);
+        b->max[i] = fmaxf(b->max[i], o->max[i]);
+    }
+}
+
+// Half the surface area of b, which is all SAH cares about
+float
+aabb_area(const struct aabb_t *b)
+{
+    float dx = b->max[0] - b->min[0], dy = b->max[1] - b->min[1], dz = b->max[2] - b->min[2];
+
+    if(dx < 0.0f || dy < 0.0f || dz < 0.0f)
+        return 0.0f;
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static void
+bound_range(void *arg)
+{
+    struct bvh_range_t *r = (struct bvh_range_t *)arg;
+    struct bvh_builder_t *b = r->b;
+    uint32_t index = 0;
+
+    aabb_empty(&r->bounds);
+    aabb_empty(&r->centroid_bounds);
+    for(size_t i = r->first; i < r->first + r->count; i++)
+    {
+        index = b->bvh->indices[i];
+        aabb_merge(&r->bounds, &b->boxes[index]);
+        aabb_grow(&r->centroid_bounds, b->centroids[index]);
+    }
+}
+
+// Sorts the primitives on r into bins, on all three axes at once.
+// r->centroid_bounds must be the centroid bounds of the whole node
+static void
+bin_range(void *arg)
+{
+    struct bvh_range_t *r = (struct bvh_range_t *)arg;
+    struct bvh_builder_t *b = r->b;
+    float scale[3] = {0.0f}, *min = r->centroid_bounds.min;
+    uint32_t index = 0;
+    int bin = 0;
+
+    for(int a = 0; a < 3; a++)
+    {
+        if(r->centroid_bounds.max[a] > min[a])
+            scale[a] = BVH_BINS / (r->centroid_bounds.max[a] - min[a]);
+
+        for(int i = 0; i < BVH_BINS; i++)
+        {
+            aabb_empty(&r->bins[a][i].bounds);
+            r->bins[a][i].count = 0;
+        }
+    }
+
+    for(size_t i = r->first; i < r->first + r->count; i++)
+    {
+        index = b->bvh->indices[i];
+        for(int a = 0; a < 3; a++)
+        {
+            bin = MIN_BIN((int)((b->centroids[index][a] - min[a]) * scale[a]));
+            r->bins[a][bin].count++;
+            aabb_merge(&r->bins[a][bin].bounds, &b->boxes[index]);
+        }
+    }
+}
+
+// Splits [first, first + count) in chunks and runs fn on each one of
+// them. Big nodes get a pool task per chunk, everything else just uses
+// local as its only chunk. Returns the chunks, which need to be freed
+// if they aren't local
+static struct bvh_range_t *
+run_ranges(struct bvh_builder_t *b, pool_task_fn_t fn, struct bvh_range_t *local, size_t first, size_t count, int *chunks)
+{
+    struct pool_task_t tasks[BVH_MAX_BUILD_THREADS];
+    struct bvh_range_t *ranges = local;
+
+    *chunks = 1;
+    if(count >= BVH_PARALLEL_THRESHOLD && build_pool != NULL && build_pool->thread_count > 1)
+    {
+        *chunks = MIN(build_pool->thread_count, BVH_MAX_BUILD_THREADS);
+        ranges = (struct bvh_range_t *)malloc(*chunks * sizeof(struct bvh_range_t));
+    }
+
+    for(int i = 0; i < *chunks; i++)
+    {
+        ranges[i].b = b;
+        ranges[i].centroid_bounds = local->centroid_bounds;
+        ranges[i].first = first + (count * i) / *chunks;
+        ranges[i].count = first + (count * (i + 1)) / *chunks - ranges[i].first;
+    }
+
+    // Chunks no thread was free to take get done by pool_wait
+    for(int i = 1; i < *chunks; i++)
+        pool_submit(build_pool, &tasks[i], fn, &ranges[i]);
+    fn(&ranges[0]);
+    for(int i = 1; i < *chunks; i++)
+        pool_wait(build_pool, &tasks[i]);
+
+    return ranges;
+}
+
+// Gets the bounds of the primitives in [first, first + count), and
+// the bounds of their centroids
+static void
+bound_node(struct bvh_builder_t *b, struct aabb_t *bounds, struct aabb_t *centroid_bounds, size_t first, size_t count)
+{
+    struct bvh_range_t local, *ranges = NULL;
+    int chunks = 0;
+
+    ranges = run_ranges(b, bound_range, &local, first, count, &chunks);
+    *bounds = ranges[0].bounds;
+    *centroid_bounds = ranges[0].centroid_bounds;
+    for(int i = 1; i < chunks; i++)
+    {
+        aabb_merge(bounds, &ranges[i].bounds);
+        aabb_merge(centroid_bounds, &ranges[i].centroid_bounds);
+    }
+
+    if(ranges != &local)
+        free(ranges);
+}
+
+// Finds the cheapest split (according to SAH) for the primitives
+// in [first, first + count). Returns the cost of that split, and
+// saves the axis and the bin the right side starts at
+static float
+find_split(struct bvh_builder_t *b, struct aabb_t *centroid_bounds, size_t first, size_t count, int *axis, int *split)
+{
+    struct bvh_range_t local, *ranges = NULL;
+    struct bvh_bin_t bins[BVH_BINS];
+    struct aabb_t left, right;
+    float left_area[BVH_BINS], best = INFINITY, cost = 0.0f;
+    size_t left_count[BVH_BINS], right_count = 0;
+    int chunks = 0;
+
+    local.centroid_bounds = *centroid_bounds;
+    ranges = run_ranges(b, bin_range, &local, first, count, &chunks);
+
+    for(int a = 0; a < 3; a++)
+    {
+        if(centroid_bounds->max[a] <= centroid_bounds->min[a])
+            continue;
+
+        // Put together what every chunk came up with
+        for(int i = 0; i < BVH_BINS; i++)
+        {
+            bins[i] = ranges[0].bins[a][i];
+            for(int c = 1; c < chunks; c++)
+            {
+                bins[i].count += ranges[c].bins[a][i].count;
+                aabb_merge(&bins[i].bounds, &ranges[c].bins[a][i].bounds);
+            }
+        }
+
+        // Sweep from the left first, then from the right, so each
+        // possible split only needs to be looked at once
+        aabb_empty(&left);
+        for(int i = 0, c = 0; i < BVH_BINS - 1; i++)
+        {
+            c += bins[i].count;
+            aabb_merge(&left, &bins[i].bounds);
+            left_area[i] = aabb_area(&left);
+            left_count[i] = c;
+        }
+
+        aabb_empty(&right);
+        right_count = 0;
+        for(int i = BVH_BINS - 1; i > 0; i--)
+        {
+            right_count += bins[i].count;
+            aabb_merge(&right, &bins[i].bounds);
+
+            if(left_count[i - 1] == 0 || right_count == 0)
+                continue;
+
+            cost = left_area[i - 1] * left_count[i - 1] + aabb_area(&right) * right_count;
+            if(cost < best)
+            {
+                best = cost;
+                *axis = a;
+                *split = i;
+            }
+        }
+    }
+
+    if(ranges != &local)
+        free(ranges);
+
+    return best;
+}
+
+static void build_node(struct bvh_builder_t *b, uint32_t node, size_t first, size_t count, int depth);
+
+static void
+build_task(void *arg)
+{
+    struct bvh_task_t *task = (struct bvh_task_t *)arg;
+
+    build_node(task->b, task->node, task->first, task->count, task->depth);
+}
+
+// Builds the subtree rooted at node out of the primitives in
+// [first, first + count)
+static void
+build_node(struct bvh_builder_t *b, uint32_t node, size_t first, size_t count, int depth)
+{
+    struct bvh_t *bvh = b->bvh;
+    struct bvh_node_t *n = &bvh->nodes[node];
+    struct aabb_t centroid_bounds;
+    struct bvh_task_t task;
+    struct pool_task_t left;
+    float cost = 0.0f, leaf_cost = 0.0f, area = 0.0f, scale = 0.0f;
+    size_t mid = first, last = first + count;
+    int axis = -1, split = 0;
+    uint32_t index = 0, children = 0;
+
+    bound_node(b, &n->bounds, &centroid_bounds, first, count);
+    n->first = first;
+    n->count = count;
+    if(count <= BVH_MIN_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+        return;
+
+    cost = find_split(b, &centroid_bounds, first, count, &axis, &split);
+
+    // Is splitting even worth it?
+    area = aabb_area(&n->bounds);
+    leaf_cost = count * BVH_INTERSECTION_COST;
+    if(area > 0.0f)
+        cost = BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * cost / area;
+    if(axis < 0 || cost >= leaf_cost)
+        return;
+
+    // Move everything that goes to the left to the front
+    scale = BVH_BINS / (centroid_bounds.max[axis] - centroid_bounds.min[axis]);
+    for(size_t i = first; i < last; i++)
+    {
+        index = bvh->indices[i];
+        if(MIN_BIN((int)((b->centroids[index][axis] - centroid_bounds.min[axis]) * scale)) < split)
+        {
+            bvh->indices[i] = bvh->indices[mid];
+            bvh->indices[mid++] = index;
+        }
+    }
+
+    // Shouldn't happen, since find_split only picks splits with
+    // something on both sides, but just in case
+    if(mid == first || mid == last)
+        mid = first + count/2;
+
+    // Both children go next to each other, wherever there's room
+    children = atomic_fetch_add(&b->node_count, 2);
+    n->first = children;
+    n->count = 0;
+
+    // Big enough subtrees get handed to the pool. It only takes as
+    // many as it has idle threads for, the rest are built right here
+    // by pool_wait
+    if(mid - first >= BVH_PARALLEL_THRESHOLD && build_pool != NULL)
+    {
+        task = (struct bvh_task_t){.b = b, .node = children, .first = first, .count = mid - first, .depth = depth + 1};
+        pool_submit(build_pool, &left, build_task, &task);
+        build_node(b, children + 1, mid, last - mid, depth + 1);
+        pool_wait(build_pool, &left);
+        return;
+    }
+
+    build_node(b, children, first, mid - first, depth + 1);
+    build_node(b, children + 1, mid, last - mid, depth + 1);
+}
+
+// Sets the pool bvh_build can use (NULL to build everything on
+// the calling thread)
+void
+bvh_set_pool(struct pool_t *pool)
+{
+    build_pool = pool;
+}
+
+// Builds a bvh over count primitives, each one of them bounded
+// by its box on boxes. Primitives are referenced by their index
+// on boxes
+void
+bvh_build(struct bvh_t *bvh, const struct aabb_t *boxes, size_t count)
+{
+    struct bvh_builder_t b;
+
+    bvh_free(bvh);
+    if(count == 0)
+        return;
+
+    b.bvh = bvh;
+    b.boxes = boxes;
+    b.centroids = (float (*)[3])malloc(count * sizeof(*b.centroids));
+    for(size_t i = 0; i < count; i++)
+        for(int a = 0; a < 3; a++)
+            b.centroids[i][a] = (boxes[i].min[a] + boxes[i].max[a]) * 0.5f;
+
+    // A binary tree with count leaves can't have more than
+    // 2*count - 1 nodes
+    bvh->nodes = (struct bvh_node_t *)malloc((2 * count - 1) * sizeof(struct bvh_node_t));
+    bvh->indices = (uint32_t *)malloc(count * sizeof(uint32_t));
+    bvh->index_count = count;
+    for(size_t i = 0; i < count; i++)
+        bvh->indices[i] = i;
+
+    atomic_init(&b.node_count, 1);
+    build_node(&b, 0, 0, count, 0);
+    bvh->node_count = atomic_load(&b.node_count);
+    bvh->build_cost = bvh_sah_cost(bvh);
+
+    free(b.centroids);
+}
+
+// Same as the builder above, but for linear bvhs. Primitives end up
+// sorted by the morton code of their centroids
+struct lbvh_builder_t
+{
+    struct bvh_t *bvh;
+    const struct aabb_t *boxes;
+    uint32_t *codes;
+};
+
+// Spreads the lower 10 bits of v so there are two zeros between
+// each one of them
+static uint32_t
+expand_bits(uint32_t v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Radix sorts codes (and indices with them) 8 bits at a time. There's
+// an even number of passes, so everything ends up back on codes and
+// indices, tmp_* are just scratch space
+static void
+sort_codes(uint32_t *codes, uint32_t *indices, uint32_t *tmp_codes, uint32_t *tmp_indices, size_t count)
+{
+    size_t offsets[256], sum = 0, bucket = 0;
+    uint32_t *swap = NULL;
+
+    for(int shift = 0; shift < 32; shift += 8)
+    {
+        memset(offsets, 0, sizeof(offsets));
+        for(size_t i = 0; i < count; i++)
+            offsets[(codes[i] >> shift) & 0xff]++;
+
+        sum = 0;
+        for(int i = 0; i < 256; i++)
+        {
+            bucket = offsets[i];
+            offsets[i] = sum;
+            sum += bucket;
+        }
+
+        for(size_t i = 0; i < count; i++)
+        {
+            bucket = offsets[(codes[i] >> shift) & 0xff]++;
+            tmp_codes[bucket] = codes[i];
+            tmp_indices[bucket] = indices[i];
+        }
+
+        swap = codes; codes = tmp_codes; tmp_codes = swap;
+        swap = indices; indices = tmp_indices; tmp_indices = swap;
+    }
+}
+
+// Finds where the (sorted) codes in [first, last) stop sharing the
+// highest bit they differ on
+static size_t
+find_lbvh_split(const uint32_t *codes, size_t first, size_t last)
+{
+    uint32_t a = codes[first], b = codes[last - 1];
+    size_t split = first, step = last - first - 1;
+    int prefix = 0;
+
+    // Everything has the same code, so just cut the range in half
+    if(a == b)
+        return first + (last - first)/2;
+
+    // Binary search for the last code that still shares more
+    // than prefix bits with the first one
+    prefix = __builtin_clz(a ^ b);
+    do
+    {
+        step = (step + 1) >> 1;
+        if(split + step < last && __builtin_clz(a ^ codes[split + step]) > prefix)
+            split += step;
+    } while(step > 1);
+
+    return split + 1;
+}
+
+static void
+build_lbvh_node(struct lbvh_builder_t *b, uint32_t node, size_t first, size_t count, int depth)
+{
+    struct bvh_t *bvh = b->bvh;
+    struct bvh_node_t *n = &bvh->nodes[node];
+    uint32_t children = 0;
+    size_t mid = 0;
+
+    n->first = first;
+    n->count = count;
+    if(count <= BVH_MIN_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1)
+    {
+        aabb_empty(&n->bounds);
+        for(size_t i = first; i < first + count; i++)
+            aabb_merge(&n->bounds, &b->boxes[bvh->indices[i]]);
+        return;
+    }
+
+    mid = find_lbvh_split(b->codes, first, first + count);
+
+    children = bvh->node_count;
+    bvh->node_count += 2;
+    n->first = children;
+    n->count = 0;
+
+    build_lbvh_node(b, children, first, mid - first, depth + 1);
+    build_lbvh_node(b, children + 1, mid, first + count - mid, depth + 1);
+
+    // Bounds come from the children, now that they are done
+    n->bounds = bvh->nodes[children].bounds;
+    aabb_merge(&n->bounds, &bvh->nodes[children + 1].bounds);
+}
+
+// Builds a linear bvh over count primitives: primitives get sorted by
+// the morton code of their centroids, and nodes are split wherever the
+// highest bit of those codes changes. Trees are worse than bvh_build's,
+// but take a fraction of the time to make. The layout is the same as
+// bvh_build's, so they're traversed (and collapsed) the same way
+void
+bvh_build_lbvh(struct bvh_t *bvh, const struct aabb_t *boxes, size_t count)
+{
+    struct lbvh_builder_t b;
+    struct aabb_t centroid_bounds;
+    float (*centroids)[3] = NULL, scale[3] = {0.0f};
+    uint32_t *tmp = NULL, cell[3] = {0};
+
+    bvh_free(bvh);
+    if(count == 0)
+        return;
+
+    centroids = (float (*)[3])malloc(count * sizeof(*centroids));
+    aabb_empty(&centroid_bounds);
+    for(size_t i = 0; i < count; i++)
+    {
+        for(int a = 0; a < 3; a++)
+            centroids[i][a] = (boxes[i].min[a] + boxes[i].max[a]) * 0.5f;
+        aabb_grow(&centroid_bounds, centroids[i]);
+    }
+
+    // Morton codes get 10 bits per axis
+    for(int a = 0; a < 3; a++)
+        if(centroid_bounds.max[a] > centroid_bounds.min[a])
+            scale[a] = 1023.0f / (centroid_bounds.max[a] - centroid_bounds.min[a]);
+
+    b.bvh = bvh;
+    b.boxes = boxes;
+    b.codes = (uint32_t *)malloc(count * sizeof(uint32_t));
+    bvh->indices = (uint32_t *)malloc(count * sizeof(uint32_t));
+    bvh->index_count = count;
+    for(size_t i = 0; i < count; i++)
+    {
+        for(int a = 0; a < 3; a++)
+            cell[a] = (uint32_t)((centroids[i][a] - centroid_bounds.min[a]) * scale[a]);
+
+        b.codes[i] = (expand_bits(cell[0]) << 2) | (expand_bits(cell[1]) << 1) | expand_bits(cell[2]);
+        bvh->indices[i] = i;
+    }
+    free(centroids);
+
+    tmp = (uint32_t *)malloc(2 * count * sizeof(uint32_t));
+    sort_codes(b.codes, bvh->indices, tmp, tmp + count, count);
+    free(tmp);
+
+    bvh->nodes = (struct bvh_node_t *)malloc((2 * count - 1) * sizeof(struct bvh_node_t));
+    bvh->node_count = 1;
+    build_lbvh_node(&b, 0, 0, count, 0);
+    bvh->build_cost = bvh_sah_cost(bvh);
+
+    free(b.codes);
+}
+
+// SAH cost of the whole tree, relative to the area of its root. Only
+// meant to compare trees over the same primitives
+float
+bvh_sah_cost(const struct bvh_t *bvh)
+{
+    const struct bvh_node_t *n = NULL;
+    float cost = 0.0f, root_area = 0.0f;
+
+    if(bvh->node_count == 0)
+        return 0.0f;
+
+    for(size_t i = 0; i < bvh->node_count; i++)
+    {
+        n = &bvh->nodes[i];
+        if(n->count == 0)
+            cost += BVH_TRAVERSAL_COST * aabb_area(&n->bounds);
+        else
+            cost += BVH_INTERSECTION_COST * aabb_area(&n->bounds) * n->count;
+    }
+
+    root_area = aabb_area(&bvh->nodes[0].bounds);
+    return root_area > 0.0f ? cost / root_area : cost;
+}
+
+// Updates the bounds of every node after the primitives moved (boxes
+// must have the same primitives, in the same order, the tree was built
+// with). Children always come after their parents, so going through
+// the nodes backwards updates them bottom up. Returns the SAH cost of
+// the refitted tree. Wide nodes need to be collapsed again after this
+float
+bvh_refit(struct bvh_t *bvh, const struct aabb_t *boxes)
+{
+    struct bvh_node_t *n = NULL;
+
+    for(size_t i = bvh->node_count; i-- > 0;)
+    {
+        n = &bvh->nodes[i];
+        if(n->count == 0)
+        {
+            n->bounds = bvh->nodes[n->first].bounds;
+            aabb_merge(&n->bounds, &bvh->nodes[n->first + 1].bounds);
+            continue;
+        }
+
+        aabb_empty(&n->bounds);
+        for(size_t p = n->first; p < n->first + n->count; p++)
+            aabb_merge(&n->bounds, &boxes[bvh->indices[p]]);
+    }
+
+    return bvh_sah_cost(bvh);
+}
+
+void
+bvh_free(struct bvh_t *bvh)
+{
+    bvh_free_wide(bvh);
+    free(bvh->nodes);
+    free(bvh->indices);
+
+    bvh->nodes = NULL;
+    bvh->indices = NULL;
+    bvh->node_count = bvh->index_count = 0;
+    bvh->build_cost = 0.0f;
+}
+
+// Picks the widest node this CPU can test in one go: 8 with AVX,
+// 4 with SSE. Returns 0 if there's no point in collapsing
+int
+bvh_wide_width(void)
+{
+#ifdef BVH_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx"))
+        return 8;
+    if(__builtin_cpu_supports("sse2"))
+        return 4;
+#endif
+    return 0;
+}
+
+// Turns binary node n into a wide node, and returns its index
+static uint32_t
+collapse_node(struct bvh_t *bvh, uint32_t n)
+{
+    struct bvh_wide_t *wide = &bvh->wide;
+    struct bvh_node_t *b = NULL;
+    uint32_t slots[BVH_WIDE_MAX], node = 0;
+    int used = 0, largest = -1, width = wide->width;
+    float area = 0.0f, best = 0.0f;
+    float *bounds = NULL;
+
+    // Start with both children of n, then keep opening the biggest
+    // inner node among them until there's no room left
+    slots[used++] = bvh->nodes[n].first;
+    slots[used++] = bvh->nodes[n].first + 1;
+    while(used < width)
+    {
+        largest = -1;
+        best = -1.0f;
+        for(int i = 0; i < used; i++)
+        {
+            b = &bvh->nodes[slots[i]];
+            area = aabb_area(&b->bounds);
+            if(b->count == 0 && area > best)
+            {
+                best = area;
+                largest = i;
+            }
+        }
+
+        if(largest < 0)
+            break;
+
+        b = &bvh->nodes[slots[largest]];
+        slots[largest] = b->first;
+        slots[used++] = b->first + 1;
+    }
+
+    node = wide->node_count++;
+    for(int i = 0; i < width; i++)
+    {
+        bounds = &wide->bounds[node * 6 * width];
+        if(i >= used)
+        {
+            // Boxes inside out can't be hit by anything
+            for(int a = 0; a < 3; a++)
+            {
+                bounds[a * width + i] = INFINITY;
+                bounds[(3 + a) * width + i] = -INFINITY;
+            }
+            wide->child[node * width + i] = BVH_WIDE_EMPTY;
+            wide->count[node * width + i] = 0;
+            continue;
+        }
+
+        b = &bvh->nodes[slots[i]];
+        for(int a = 0; a < 3; a++)
+        {
+            bounds[a * width + i] = b->bounds.min[a];
+            bounds[(3 + a) * width + i] = b->bounds.max[a];
+        }
+
+        wide->count[node * width + i] = b->count;
+        if(b->count > 0)
+            wide->child[node * width + i] = b->first;
+        else
+            wide->child[node * width + i] = collapse_node(bvh, slots[i]);
+    }
+
+    return node;
+}
+
+// Builds the wide version of bvh, with width (4 or 8) children per node
+void
+bvh_collapse(struct bvh_t *bvh, int width)
+{
+    struct bvh_wide_t *wide = &bvh->wide;
+    struct bvh_node_t *root = NULL;
+    float *bounds = NULL;
+
+    bvh_free_wide(bvh);
+    if(bvh->node_count == 0 || width < 2 || width > BVH_WIDE_MAX)
+        return;
+
+    // Never more wide nodes than binary ones
+    wide->width = width;
+    wide->bounds = (float *)malloc(bvh->node_count * 6 * width * sizeof(float));
+    wide->child = (uint32_t *)malloc(bvh->node_count * width * sizeof(uint32_t));
+    wide->count = (uint32_t *)malloc(bvh->node_count * width * sizeof(uint32_t));
+
+    root = &bvh->nodes[0];
+    if(root->count == 0)
+    {
+        collapse_node(bvh, 0);
+        return;
+    }
+
+    // Just a leaf, so make a root with it as its only child
+    wide->node_count = 1;
+    bounds = wide->bounds;
+    for(int i = 0; i < width; i++)
+    {
+        for(int a = 0; a < 3; a++)
+        {
+            bounds[a * width + i] = i == 0 ? root->bounds.min[a] : INFINITY;
+            bounds[(3 + a) * width + i] = i == 0 ? root->bounds.max[a] : -INFINITY;
+        }
+        wide->child[i] = i == 0 ? root->first : BVH_WIDE_EMPTY;
+        wide->count[i] = i == 0 ? root->count : 0;
+    }
+}
+
+void
+bvh_free_wide(struct bvh_t *bvh)
+{
+    free(bvh->wide.bounds);
+    free(bvh->wide.child);
+    free(bvh->wide.count);
+    free(bvh->wide.qbounds);
+    free(bvh->wide.origin);
+    free(bvh->wide.scale);
+
+    bvh->wide = (struct bvh_wide_t){0};
+}
+
+// Swaps the float bounds of the wide nodes of bvh for 8 bit ones
+// relative to their parent, which takes them from 24 to 6 bytes per
+// child. Boxes only ever grow when rounded, so nothing gets missed.
+// Only the root of the binary tree is kept, so the result can't be
+// refitted or collapsed again, just traversed
+void
+bvh_quantize(struct bvh_t *bvh)
+{
+    struct bvh_wide_t *wide = &bvh->wide;
+    int width = wide->width;
+    float *bounds = NULL, lo = 0.0f, hi = 0.0f, o = 0.0f, s = 0.0f;
+    uint8_t *q = NULL;
+    int qlo = 0, qhi = 0;
+
+    if(wide->node_count == 0 || wide->qbounds != NULL)
+        return;
+
+    wide->qbounds = (uint8_t *)malloc(wide->node_count * 6 * width);
+    wide->origin = (float *)malloc(wide->node_count * 3 * sizeof(float));
+    wide->scale = (float *)malloc(wide->node_count * 3 * sizeof(float));
+
+    for(size_t n = 0; n < wide->node_count; n++)
+    {
+        bounds = &wide->bounds[n * 6 * width];
+        q = &wide->qbounds[n * 6 * width];
+
+        for(int a = 0; a < 3; a++)
+        {
+            // Bounds of the node itself
+            lo = INFINITY;
+            hi = -INFINITY;
+            for(int i = 0; i < width; i++)
+            {
+                if(wide->child[n * width + i] == BVH_WIDE_EMPTY)
+                    continue;
+                lo = MIN(lo, bounds[a * width + i]);
+                hi = MAX(hi, bounds[(3 + a) * width + i]);
+            }
+
+            // 255 steps need to reach all the way to hi, even after
+            // rounding. Flat nodes get any step at all, so empty
+            // children still come out inside out
+            o = lo;
+            s = hi > lo ? (hi - lo) / 255.0f : 1.0f;
+            while(o + 255.0f * s < hi)
+                s *= 1.0f + 1.0f / 1024.0f;
+
+            wide->origin[n * 3 + a] = o;
+            wide->scale[n * 3 + a] = s;
+
+            for(int i = 0; i < width; i++)
+            {
+                if(wide->child[n * width + i] == BVH_WIDE_EMPTY)
+                {
+                    q[a * width + i] = 255;
+                    q[(3 + a) * width + i] = 0;
+                    continue;
+                }
+
+                qlo = (int)floorf((bounds[a * width + i] - o) / s);
+                qhi = (int)ceilf((bounds[(3 + a) * width + i] - o) / s);
+                qlo = qlo < 0 ? 0 : qlo > 255 ? 255 : qlo;
+                qhi = qhi < 0 ? 0 : qhi > 255 ? 255 : qhi;
+                while(qlo > 0 && o + qlo * s > bounds[a * width + i])
+                    qlo--;
+                while(qhi < 255 && o + qhi * s < bounds[(3 + a) * width + i])
+                    qhi++;
+
+                q[a * width + i] = (uint8_t)qlo;
+                q[(3 + a) * width + i] = (uint8_t)qhi;
+            }
+        }
+    }
+
+    free(wide->bounds);
+    wide->bounds = NULL;
+
+    // Traversal only needs the root of the binary tree
+    bvh->nodes = (struct bvh_node_t *)realloc(bvh->nodes, sizeof(struct bvh_node_t));
+    bvh->node_count = 1;
+    free(bvh->indices);
+    bvh->indices = NULL;
+    bvh->index_count = 0;
+}
+
+// Bytes taken by everything bvh has allocated
+size_t
+bvh_memory(const struct bvh_t *bvh)
+{
+    const struct bvh_wide_t *wide = &bvh->wide;
+    size_t bytes = 0;
+
+    bytes += bvh->node_count * sizeof(struct bvh_node_t);
+    bytes += bvh->index_count * sizeof(uint32_t);
+    bytes += wide->node_count * wide->width * 2 * sizeof(uint32_t);
+    if(wide->qbounds != NULL)
+        bytes += wide->node_count * (6 * wide->width + 6 * sizeof(float));
+    else
+        bytes += wide->node_count * 6 * wide->width * sizeof(float);
+
+    return bytes;
+}
+
+// Slab test against every child of a wide node, same as the one on
+// raytracer.c but picking the near and far planes by the sign of the
+// ray, which also makes the empty (inside out) children always miss.
+// NaNs (0 * inf) are kept from shrinking the interval by keeping them
+// on the first operand of min/max
+static int
+intersect_scalar(const float *bounds, int width, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX])
+{
+    int mask = 0;
+    float t0 = 0.0f, t1 = 0.0f, tn = 0.0f, tf = 0.0f;
+
+    for(int i = 0; i < width; i++)
+    {
+        t0 = 0.0f;
+        t1 = t_max;
+        for(int a = 0; a < 3; a++)
+        {
+            tn = (bounds[(sign[a] ? 3 + a : a) * width + i] - orig[a]) * rcp[a];
+            tf = (bounds[(sign[a] ? a : 3 + a) * width + i] - orig[a]) * rcp[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+
+        t_near[i] = t0;
+        if(t0 <= t1)
+            mask |= 1 << i;
+    }
+
+    return mask;
+}
+
+#ifdef BVH_X86_SIMD
+static int
+intersect_sse(const float *bounds, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX])
+{
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(t_max), o, r, tn, tf;
+
+    for(int a = 0; a < 3; a++)
+    {
+        o = _mm_set1_ps(orig[a]);
+        r = _mm_set1_ps(rcp[a]);
+        tn = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&bounds[(sign[a] ? 3 + a : a) * 4]), o), r);
+        tf = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&bounds[(sign[a] ? a : 3 + a) * 4]), o), r);
+
+        // maxps/minps return their second operand on NaN
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+    }
+
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+__attribute__((target("avx")))
+static int
+intersect_avx(const float *bounds, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX])
+{
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(t_max), o, r, tn, tf;
+
+    for(int a = 0; a < 3; a++)
+    {
+        o = _mm256_set1_ps(orig[a]);
+        r = _mm256_set1_ps(rcp[a]);
+        tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&bounds[(sign[a] ? 3 + a : a) * 8]), o), r);
+        tf = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(&bounds[(sign[a] ? a : 3 + a) * 8]), o), r);
+
+        t0 = _mm256_max_ps(tn, t0);
+        t1 = _mm256_min_ps(tf, t1);
+    }
+
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+
+// Quantized versions of the above. Rows of children come as bytes,
+// and get turned into distances along the ray in one go, since
+// origin + q * scale - orig is just q * (scale * rcp) plus a constant.
+// 0 * inf turns into NaNs here too, which only make boxes bigger
+static inline __m128
+decode_sse(const uint8_t *q)
+{
+    __m128i x = _mm_cvtsi32_si128((int)(q[0] | q[1] << 8 | q[2] << 16 | (uint32_t)q[3] << 24));
+
+    x = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+    x = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+    return _mm_cvtepi32_ps(x);
+}
+
+static int
+intersect_sse_quantized(const uint8_t *q, const float *origin, const float *scale, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX])
+{
+    __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(t_max), s, o, tn, tf;
+
+    for(int a = 0; a < 3; a++)
+    {
+        s = _mm_set1_ps(scale[a] * rcp[a]);
+        o = _mm_set1_ps((origin[a] - orig[a]) * rcp[a]);
+        tn = _mm_add_ps(_mm_mul_ps(decode_sse(&q[(sign[a] ? 3 + a : a) * 4]), s), o);
+        tf = _mm_add_ps(_mm_mul_ps(decode_sse(&q[(sign[a] ? a : 3 + a) * 4]), s), o);
+
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+    }
+
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+__attribute__((target("avx")))
+static inline __m256
+decode_avx(const uint8_t *q)
+{
+    __m128i x = _mm_loadl_epi64((const __m128i *)q);
+
+    x = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+    return _mm256_insertf128_ps(
+        _mm256_castps128_ps256(_mm_cvtepi32_ps(_mm_unpacklo_epi16(x, _mm_setzero_si128()))),
+        _mm_cvtepi32_ps(_mm_unpackhi_epi16(x, _mm_setzero_si128())), 1
+    );
+}
+
+__attribute__((target("avx")))
+static int
+intersect_avx_quantized(const uint8_t *q, const float *origin, const float *scale, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX])
+{
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(t_max), s, o, tn, tf;
+
+    for(int a = 0; a < 3; a++)
+    {
+        s = _mm256_set1_ps(scale[a] * rcp[a]);
+        o = _mm256_set1_ps((origin[a] - orig[a]) * rcp[a]);
+        tn = _mm256_add_ps(_mm256_mul_ps(decode_avx(&q[(sign[a] ? 3 + a : a) * 8]), s), o);
+        tf = _mm256_add_ps(_mm256_mul_ps(decode_avx(&q[(sign[a] ? a : 3 + a) * 8]), s), o);
+
+        t0 = _mm256_max_ps(tn, t0);
+        t1 = _mm256_min_ps(tf, t1);
+    }
+
+    _mm256_storeu_ps(t_near, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+// Tests ray against every child of wide node. Returns a mask with
+// a bit set for every child it goes through before t_max, and
+// where it enters each one of them on t_near
+int
+bvh_wide_intersect(const struct bvh_wide_t *wide, uint32_t node, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX])
+{
+    int width = wide->width, mask = 0;
+    float decoded[6 * BVH_WIDE_MAX];
+    const float *o = NULL, *s = NULL;
+    const uint8_t *q = NULL;
+
+    if(wide->qbounds == NULL)
+    {
+#ifdef BVH_X86_SIMD
+        // bvh_wide_width already made sure the CPU can take it
+        if(width == 8)
+            return intersect_avx(&wide->bounds[node * 6 * 8], orig, rcp, sign, t_max, t_near);
+        if(width == 4)
+            return intersect_sse(&wide->bounds[node * 6 * 4], orig, rcp, sign, t_max, t_near);
+#endif
+        return intersect_scalar(&wide->bounds[node * 6 * width], width, orig, rcp, sign, t_max, t_near);
+    }
+
+    q = &wide->qbounds[node * 6 * width];
+    o = &wide->origin[node * 3];
+    s = &wide->scale[node * 3];
+
+#ifdef BVH_X86_SIMD
+    if(width == 8)
+        mask = intersect_avx_quantized(q, o, s, orig, rcp, sign, t_max, t_near);
+    else if(width == 4)
+        mask = intersect_sse_quantized(q, o, s, orig, rcp, sign, t_max, t_near);
+    else
+#endif
+    {
+        for(int a = 0; a < 6; a++)
+            for(int i = 0; i < width; i++)
+                decoded[a * width + i] = o[a % 3] + (float)q[a * width + i] * s[a % 3];
+        mask = intersect_scalar(decoded, width, orig, rcp, sign, t_max, t_near);
+    }
+
+    // Empty children are inside out, but rounding can flatten them
+    // into boxes rays go through, so they're dropped here instead
+    for(int i = 0; i < width; i++)
+        if(wide->child[node * width + i] == BVH_WIDE_EMPTY)
+            mask &= ~(1 << i);
+
+    return mask;
+}
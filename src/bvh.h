@@ -0,0 +1,111 @@
+#ifndef BVH_H__
+#define BVH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+// Number of buckets primitives get sorted into when looking
+// for the best split on each axis
+#define BVH_BINS                    16
+
+// Nodes with this many primitives (or less) are always leaves
+#define BVH_MIN_LEAF_SIZE           2
+// Past this depth everything left becomes a leaf. Traversal
+// relies on this to size its stack
+#define BVH_MAX_DEPTH               64
+
+// Widest node bvh_collapse can make
+#define BVH_WIDE_MAX                8
+// Marks unused children on wide nodes
+#define BVH_WIDE_EMPTY              UINT32_MAX
+
+// Nodes with at least this many primitives are bounded and
+// binned by several threads, and their subtrees handed to
+// the pool (see bvh_set_pool)
+#define BVH_PARALLEL_THRESHOLD      65536
+#define BVH_MAX_BUILD_THREADS       64
+
+// Refitted trees get rebuilt once their SAH cost grows past
+// this many times what it was when they were built
+#define BVH_REFIT_MAX_GROWTH        1.25f
+
+// Relative cost of visiting a node vs intersecting a primitive
+#define BVH_TRAVERSAL_COST          1.0f
+#define BVH_INTERSECTION_COST       1.0f
+
+struct aabb_t
+{
+    float min[3], max[3];
+};
+
+struct bvh_node_t
+{
+    struct aabb_t bounds;
+
+    // On leaves, first is the index (on bvh_t.indices) of the first
+    // primitive and count how many there are. Inner nodes have a count
+    // of 0, and first pointing to their left child. The right one is
+    // always right after it
+    uint32_t first, count;
+};
+
+// Same tree, but with up to width (4 or 8) children per node so all of
+// them can be tested against a ray at once. Node i keeps the bounds of
+// its children on bounds[i*6*width], as 6 arrays of width floats each:
+// min x, min y, min z, max x, max y and max z. Children work just like
+// on bvh_node_t, only a count of 0 means child[] is another wide node
+struct bvh_wide_t
+{
+    int width;
+
+    float *bounds;
+    uint32_t *child, *count;
+    size_t node_count;
+
+    // After bvh_quantize, bounds is gone and node i keeps the bounds of
+    // its children on qbounds instead (laid out the same way), as 8 bit
+    // steps of scale[i*3 + axis] away from origin[i*3 + axis], which are
+    // the min corner of node i itself
+    uint8_t *qbounds;
+    float *origin, *scale;
+};
+
+struct bvh_t
+{
+    struct bvh_node_t *nodes;
+    size_t node_count;
+
+    uint32_t *indices;
+    size_t index_count;
+
+    // SAH cost right after being built, see bvh_refit
+    float build_cost;
+
+    // Only there after bvh_collapse
+    struct bvh_wide_t wide;
+};
+
+void aabb_empty(struct aabb_t *b);
+void aabb_grow(struct aabb_t *b, const float p[3]);
+void aabb_merge(struct aabb_t *b, const struct aabb_t *o);
+float aabb_area(const struct aabb_t *b);
+
+void bvh_set_pool(struct pool_t *pool);
+void bvh_build(struct bvh_t *bvh, const struct aabb_t *boxes, size_t count);
+void bvh_build_lbvh(struct bvh_t *bvh, const struct aabb_t *boxes, size_t count);
+void bvh_free(struct bvh_t *bvh);
+
+float bvh_sah_cost(const struct bvh_t *bvh);
+float bvh_refit(struct bvh_t *bvh, const struct aabb_t *boxes);
+
+int bvh_wide_width(void);
+void bvh_collapse(struct bvh_t *bvh, int width);
+void bvh_free_wide(struct bvh_t *bvh);
+void bvh_quantize(struct bvh_t *bvh);
+size_t bvh_memory(const struct bvh_t *bvh);
+int bvh_wide_intersect(const struct bvh_wide_t *wide, uint32_t node, const float orig[3], const float rcp[3], const short sign[3], float t_max, float t_near[BVH_WIDE_MAX]);
+
+#endif
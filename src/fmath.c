@@ -28,3 +28,24 @@ solve_quadratic(float a, float b, float c, float *x1, float *x2)
     return true;
 }
 
+
+// Mixes a and b into a well distributed 32 bit value. This is
+// Jarzynski and Olano's pcg2d: each one goes through an lcg step of
+// its own, and only then do they get mixed into each other, twice.
+// Up to the last round, which only x needs, all of it can be undone,
+// so no two (a, b) pairs end up the same, and x alone only collides
+// as often as chance says it should
+uint32_t
+rng_hash(uint32_t a, uint32_t b)
+{
+    uint32_t x = a * 1664525u + 1013904223u, y = b * 1664525u + 1013904223u;
+
+    x += y * 1664525u;
+    y += x * 1664525u;
+    x ^= x >> 16;
+    y ^= y >> 16;
+    x += y * 1664525u;
+    x ^= x >> 16;
+
+    return x;
+}
@@ -5,7 +5,12 @@
 #include "utilities.h"
 
 #define pow2(x)                             (x*x)
-#define randf()                             ((float)rand()/(float)(RAND_MAX + 1.0))
-#define rrandf(min, max)                    (min + (max - min)*randf())
 
 bool solve_quadratic(float a, float b, float c, float *x1, float *x2);
+
+// Counter based random numbers: the n-th number of key is just
+// rng_hash(key, n), so there's no state to carry around. The
+// raytracer's sampler (see sampler.h) keys everything by the frame,
+// pixel and sample being rendered, which keeps the output the same
+// no matter which thread ends up rendering which pixel
+uint32_t rng_hash(uint32_t a, uint32_t b);
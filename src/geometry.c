@@ -76,71 +76,6 @@ clear_matrix(matrix_t m)
     copy_matrix(b, m);
 }
 
-// r = a - b
-void
-substract_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
-{
-    r->x = a->x - b->x;
-    r->y = a->y - b->y;
-    r->z = a->z - b->z;
-    r->w = 0.0;
-}
-
-// Returns a + b
-void
-add_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
-{
-    r->x = a->x + b->x;
-    r->y = a->y + b->y;
-    r->z = a->z + b->z;
-    r->w = 0.0;
-}
-
-// r = p * s 
-void
-scale_pv(struct pv_t * p, float s, struct pv_t *r)
-{
-    r->x = p->x * s;
-    r->y = p->y * s;
-    r->z = p->z * s;
-}
-
-// r = p / s
-void
-divide_pv(struct pv_t *p, float s, struct pv_t *r)
-{
-    scale_pv(p, 1.0/s, r);
-}
-
-// r = a * b
-void
-multiply_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
-{
-    r->x = a->x * b->x;
-    r->y = a->y * b->y;
-    r->z = a->z * b->z;
-}
-
-// Returns ||v||
-float
-magnitude_pv(struct pv_t *v)
-{
-    return sqrtf(pow2((v)->x) + pow2((v)->y) + pow2((v)->z));
-}
-
-// r = v/(||v||)
-void
-normalize_pv(struct pv_t *v, struct pv_t *r)
-{
-    float m = 0.0;
-
-    m = magnitude_pv(v);
-   
-    r->x = v->x/m;    
-    r->y = v->y/m;    
-    r->z = v->z/m;    
-}
-
 // r = 1/p
 // Returns the inverse of p.
 // I had to get a little experimental with this, so I hope
@@ -156,50 +91,6 @@ void inverse_pv(struct pv_t* p, struct pv_t *r)
 #undef csgin
 }
 
-float
-dot_product(struct pv_t *a, struct pv_t *b)
-{
-    return a->x * b->x + a->y * b->y + a->z * b->z;
-}
-
-void
-cross_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
-{
-    r->x = a->y * b->z - a->z * b->y;
-    r->y = a->z * b->x - a->x * b->z;
-    r->z = a->x * b->y - a->y * b->x;
-}
-
-// Okay, so everyone seems to 
-// Checks if pointvector is a point
-// Just in case I need to add other criteria to this
-// later
-static inline bool 
-is_point(struct pv_t *p) 
-{
-    return p->w > 0;
-}
-
-// Converts a pv_t to a column_t
-static inline void
-pv_to_column(struct pv_t *p, column_t c)
-{
-    c[0][0] = p->x;
-    c[1][0] = p->y;
-    c[2][0] = p->z;
-    c[3][0] = p->w;   
-}
-
-// Converts a column_t to a pv_t
-static inline void
-column_to_pv(column_t c, struct pv_t *p)
-{
-    p->x = c[0][0];
-    p->y = c[1][0];
-    p->z = c[2][0];
-    p->w = c[3][0];
-}
-
 // Yeah... I don't have time to worry about 
 // how to calculate the inverse of a matrix.
 // Like, I know how to do this, but I was spending
@@ -377,37 +268,6 @@ inv_matrix(matrix_t m, matrix_t r)
         copy_matrix(m, r);
 }
 
-// r = m * x
-// Matrix times column operation. Do not use
-// c as r as well. This will cause problems
-void
-mxc(matrix_t m, column_t c, column_t r)
-{
-    r[0][0] = m[0][0] * c[0][0] + m[0][1] * c[1][0] + m[0][2] * c[2][0] + m[0][3] * c[3][0];
-    r[1][0] = m[1][0] * c[0][0] + m[1][1] * c[1][0] + m[1][2] * c[2][0] + m[1][3] * c[3][0];
-    r[2][0] = m[2][0] * c[0][0] + m[2][1] * c[1][0] + m[2][2] * c[2][0] + m[2][3] * c[3][0];
-    r[3][0] = m[3][0] * c[0][0] + m[3][1] * c[1][0] + m[3][2] * c[2][0] + m[3][3] * c[3][0];
-}
-
-// r = m * c
-// Matrix times column operation. Do not use
-// c as r as well. This will cause problems
-void
-mxm(matrix_t m, matrix_t c, matrix_t r)
-{
-    unsigned char i = 0;
-
-    // I know I didn't NEED to use a loop here, but this is due in
-    // a week
-    for(i = 0; i < 4; i++)
-    {
-        r[0][i] = m[0][0] * c[0][i] + m[0][1] * c[1][i] + m[0][2] * c[2][i] + m[0][3] * c[3][i];
-        r[1][i] = m[1][0] * c[0][i] + m[1][1] * c[1][i] + m[1][2] * c[2][i] + m[1][3] * c[3][i];
-        r[2][i] = m[2][0] * c[0][i] + m[2][1] * c[1][i] + m[2][2] * c[2][i] + m[2][3] * c[3][i];
-        r[3][i] = m[3][0] * c[0][i] + m[3][1] * c[1][i] + m[3][2] * c[2][i] + m[3][3] * c[3][i];
-    }
-}
-
 // m = Im
 void
 make_identity_matrix(matrix_t m)
@@ -507,41 +367,203 @@ make_rotation_matrix(float t, struct pv_t *u, matrix_t m)
     m[3][3] = 1.0;
 }
 
-// Apply transform matrix m to pv
+// Pool transform_vertices and friends can use, if any
+static struct pool_t *vertex_pool = NULL;
+
+// What one of the threads of run_vertex_jobs works on. Vertices are
+// one array per axis, except for load_vertices' xyz. Only normal_job
+// needs a second source
+struct vertex_job_t
+{
+    void (*fn)(struct vertex_job_t *job);
+
+    matrix_t m;
+    float w;
+    float *src[3], *src2[3], *dst[3];
+    const float *xyz;
+
+    size_t first, count;
+};
+
+// Sets the pool transform_vertices can use (NULL to do everything
+// on the calling thread)
+void
+geometry_set_pool(struct pool_t *pool)
+{
+    vertex_pool = pool;
+}
+
+static void
+vertex_job_task(void *arg)
+{
+    struct vertex_job_t *job = (struct vertex_job_t *)arg;
+
+    job->fn(job);
+}
+
+// Same as run_ranges on bvh.c: splits [0, count) in chunks, one per
+// thread of the pool, and runs job->fn on each one. Short arrays aren't
+// worth the trouble, so they stay on this thread
+static void
+run_vertex_jobs(struct vertex_job_t *job, size_t count)
+{
+    struct pool_task_t tasks[GEOMETRY_MAX_THREADS];
+    struct vertex_job_t jobs[GEOMETRY_MAX_THREADS];
+    int chunks = 1;
+
+    if(count >= GEOMETRY_PARALLEL_THRESHOLD && vertex_pool != NULL && vertex_pool->thread_count > 1)
+        chunks = MIN(vertex_pool->thread_count, GEOMETRY_MAX_THREADS);
+
+    for(int i = 0; i < chunks; i++)
+    {
+        jobs[i] = *job;
+        jobs[i].first = (count * i) / chunks;
+        jobs[i].count = (count * (i + 1)) / chunks - jobs[i].first;
+    }
+
+    // Chunks no thread was free to take get done by pool_wait
+    for(int i = 1; i < chunks; i++)
+        pool_submit(vertex_pool, &tasks[i], vertex_job_task, &jobs[i]);
+    job->fn(&jobs[0]);
+    for(int i = 1; i < chunks; i++)
+        pool_wait(vertex_pool, &tasks[i]);
+}
+
+// Does the same math as transform_pv (in the same order), but on
+// 4 vertices at a time where there's SSE. Like normal_job, that's up to
+// VECMATH_X86_SIMD, which is on for every x86 build (optimized or not)
+// that doesn't set VECMATH_NO_SIMD, same as raytracer.c and bvh.c
+static void
+transform_job(struct vertex_job_t *job)
+{
+    float (*m)[4] = job->m;
+    float tw[3] = {m[0][3] * job->w, m[1][3] * job->w, m[2][3] * job->w};
+    float *const *src = job->src, *const *dst = job->dst;
+    float x, y, z;
+    size_t i = job->first, end = job->first + job->count;
+
+#ifdef VECMATH_X86_SIMD
+    __m128 c[3][3], t[3], vx, vy, vz;
+
+    for(int r = 0; r < 3; r++)
+    {
+        for(int a = 0; a < 3; a++)
+            c[r][a] = _mm_set1_ps(m[r][a]);
+        t[r] = _mm_set1_ps(tw[r]);
+    }
+
+    for(; i + 4 <= end; i += 4)
+    {
+        vx = _mm_loadu_ps(&src[0][i]);
+        vy = _mm_loadu_ps(&src[1][i]);
+        vz = _mm_loadu_ps(&src[2][i]);
+        for(int r = 0; r < 3; r++)
+        {
+            _mm_storeu_ps(&dst[r][i], _mm_add_ps(_mm_add_ps(_mm_add_ps(
+                _mm_mul_ps(c[r][0], vx), _mm_mul_ps(c[r][1], vy)), _mm_mul_ps(c[r][2], vz)), t[r]));
+        }
+    }
+#endif
+
+    for(; i < end; i++)
+    {
+        x = src[0][i];
+        y = src[1][i];
+        z = src[2][i];
+        for(int r = 0; r < 3; r++)
+            dst[r][i] = m[r][0] * x + m[r][1] * y + m[r][2] * z + tw[r];
+    }
+}
+
+// Multiplies count points (w = 1) or directions (w = 0) by m, and
+// saves them on dst, which can be src too. Both have one array per
+// axis. Big arrays get split between threads (see geometry_set_pool)
 void
-transform_pv(matrix_t m, struct pv_t *p, struct pv_t *r)
+transform_vertices(matrix_t m, float w, float *src[3], float *dst[3], size_t count)
 {
-    column_t a, c;
-    
-    pv_to_column(p, c);
-    mxc(m, c, a);
-    column_to_pv(a, r);
+    struct vertex_job_t job = {.fn = transform_job, .w = w};
+
+    copy_matrix(m, job.m);
+    memcpy(job.src, src, sizeof(job.src));
+    memcpy(job.dst, dst, sizeof(job.dst));
+    run_vertex_jobs(&job, count);
 }
 
-// Multiply m by all the pv_t on src and save
-// the results on dst
+static void
+load_job(struct vertex_job_t *job)
+{
+    const float *v = job->xyz;
+    float *x = job->dst[0], *y = job->dst[1], *z = job->dst[2];
+
+    for(size_t i = job->first; i < job->first + job->count; i++)
+    {
+        x[i] = v[3 * i];
+        y[i] = v[3 * i + 1];
+        z[i] = v[3 * i + 2];
+    }
+}
+
+// Splits count vertices stored as x, y, z, x, y, z... (like wavefront
+// files have them) into one array per axis on dst. Same threads as
+// transform_vertices
 void
-transform_pv_arr(matrix_t m, struct pv_t *src, struct pv_t *dst, size_t s)
+load_vertices(const float *xyz, float *dst[3], size_t count)
+{
+    struct vertex_job_t job = {.fn = load_job, .xyz = xyz};
+
+    memcpy(job.dst, dst, sizeof(job.dst));
+    run_vertex_jobs(&job, count);
+}
+
+// Works out the normals of triangles [first, first + count) with
+// edges job->src and job->src2 onto job->dst, the same way (and with
+// the same results as) set_mesh_triangle
+static void
+normal_job(struct vertex_job_t *job)
 {
-    column_t a, c;
+    float *const *a = job->src, *const *b = job->src2, *const *n = job->dst;
+    struct pv_t e1, e2, c;
+    size_t i = job->first, end = job->first + job->count;
 
-    while(s > 0)
+#ifdef VECMATH_X86_SIMD
+    __m128 ax, ay, az, bx, by, bz, cx, cy, cz, m;
+
+    for(; i + 4 <= end; i += 4)
     {
-        s--;
-        pv_to_column(&src[s], c);
-        mxc(m, c, a);
-        column_to_pv(a, &dst[s]);
+        ax = _mm_loadu_ps(&a[0][i]); ay = _mm_loadu_ps(&a[1][i]); az = _mm_loadu_ps(&a[2][i]);
+        bx = _mm_loadu_ps(&b[0][i]); by = _mm_loadu_ps(&b[1][i]); bz = _mm_loadu_ps(&b[2][i]);
+
+        cx = _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by));
+        cy = _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz));
+        cz = _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx));
+        m = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(cx, cx), _mm_mul_ps(cy, cy)), _mm_mul_ps(cz, cz)));
+
+        _mm_storeu_ps(&n[0][i], _mm_div_ps(cx, m));
+        _mm_storeu_ps(&n[1][i], _mm_div_ps(cy, m));
+        _mm_storeu_ps(&n[2][i], _mm_div_ps(cz, m));
+    }
+#endif
+
+    for(; i < end; i++)
+    {
+        e1 = (struct pv_t){a[0][i], a[1][i], a[2][i], 0.0f};
+        e2 = (struct pv_t){b[0][i], b[1][i], b[2][i], 0.0f};
+        cross_pv(&e1, &e2, &c);
+        normalize_pv(&c, &c);
+        n[0][i] = c.x; n[1][i] = c.y; n[2][i] = c.z;
     }
 }
 
-// Reflects i around normal n
+// Multiply m by all the pv_t on src and save
+// the results on dst
 void
-reflect_pv(struct pv_t *i, struct pv_t *n, struct pv_t *r)
+transform_pv_arr(matrix_t m, struct pv_t *src, struct pv_t *dst, size_t s)
 {
-    struct pv_t p = {0.0};
+    vec_t c[4];
 
-    scale_pv(n, dot_product(i, n) * 2.0, &p);
-    substract_pv(i, &p, r);
+    vec_matrix_columns(m, c);
+    for(size_t i = 0; i < s; i++)
+        vec_store(&dst[i], vec_transform_columns(c, vec_load(&src[i])));
 }
 
 void
@@ -601,41 +623,419 @@ transform_triangle(struct triangle_t *t, matrix_t m, struct triangle_t *r)
     make_triangle(&t->edges[0], &t->edges[1], &t->edges[2], r);
 }
 
+// Allocates room for c triangles on d. Every component of
+// every triangle goes on the same block, right after the other
+static void
+alloc_triangles(struct mesh_data_t *d, size_t c)
+{
+    float *block = (float *)calloc(12 * c, sizeof(float));
+
+    for(int a = 0; a < 3; a++)
+    {
+        d->v0[a] = block + a * c;
+        d->e1[a] = block + (3 + a) * c;
+        d->e2[a] = block + (6 + a) * c;
+        d->n[a] = block + (9 + a) * c;
+    }
+    d->triangle_count = c;
+}
+
 void 
 new_mesh(struct mesh_t *m, size_t c)
 {
     matrix_t i;
 
-    m->triangles = (struct triangle_t *)calloc(c, sizeof(struct triangle_t));
-    m->triangle_count = c;
+    m->data = (struct mesh_data_t *)calloc(1, sizeof(struct mesh_data_t));
+    alloc_triangles(m->data, c);
+    m->data->refs = 1;
+    m->update = MESH_UPDATE_INSTANCE;
 
     make_identity_matrix(i);
     copy_matrix(i, m->transform);
     copy_matrix(i, m->inv_transform);
 }
 
+// Same as new_mesh, but for meshes with vertex_count shared
+// vertices and face_count triangles between them
+void
+new_indexed_mesh(struct mesh_t *m, size_t vertex_count, size_t face_count)
+{
+    float *block = (float *)calloc(3 * vertex_count, sizeof(float));
+
+    new_mesh(m, 0);
+    for(int a = 0; a < 3; a++)
+        m->data->vertices[a] = block + a * vertex_count;
+    m->data->vertex_count = vertex_count;
+
+    m->data->faces = (uint32_t *)calloc(3 * face_count, sizeof(uint32_t));
+    m->data->triangle_count = face_count;
+}
+
+void
+set_mesh_vertex(struct mesh_t *m, size_t i, struct pv_t *v)
+{
+    m->data->vertices[0][i] = v->x;
+    m->data->vertices[1][i] = v->y;
+    m->data->vertices[2][i] = v->z;
+}
+
+// Sets every vertex of indexed mesh m at once, out of x, y, z
+// triples like the ones wavefront files have
+void
+set_mesh_vertices(struct mesh_t *m, const float *xyz)
+{
+    load_vertices(xyz, m->data->vertices, m->data->vertex_count);
+}
+
+// Makes triangle i of m out of vertices a, b and c
+void
+set_mesh_face(struct mesh_t *m, size_t i, uint32_t a, uint32_t b, uint32_t c)
+{
+    m->data->faces[3 * i] = a;
+    m->data->faces[3 * i + 1] = b;
+    m->data->faces[3 * i + 2] = c;
+}
+
+// Quantizes the vertices of indexed mesh m to 16 bits per axis within
+// its bounds, then builds its bvh over them and quantizes that too. The
+// result is read only: m needs to stay an instance from then on
+void
+compress_mesh(struct mesh_t *m)
+{
+    struct mesh_data_t *d = m->data;
+    size_t before = 0, after = 0, vertices = 0, tree = 0;
+    uint16_t *block = NULL;
+    float lo = 0.0f, hi = 0.0f, q = 0.0f;
+
+    if(d->faces == NULL || d->qvertices[0] != NULL)
+        return;
+
+    // What it takes uncompressed
+    vertices = 3 * d->vertex_count * sizeof(float);
+    before = vertices + 3 * d->triangle_count * sizeof(uint32_t);
+
+    block = (uint16_t *)malloc(3 * d->vertex_count * sizeof(uint16_t));
+    for(int a = 0; a < 3; a++)
+    {
+        lo = INFINITY;
+        hi = -INFINITY;
+        for(size_t i = 0; i < d->vertex_count; i++)
+        {
+            lo = MIN(lo, d->vertices[a][i]);
+            hi = MAX(hi, d->vertices[a][i]);
+        }
+
+        d->qmin[a] = lo;
+        d->qscale[a] = hi > lo ? (hi - lo) / 65535.0f : 1.0f;
+        d->qvertices[a] = block + a * d->vertex_count;
+        for(size_t i = 0; i < d->vertex_count; i++)
+        {
+            q = roundf((d->vertices[a][i] - lo) / d->qscale[a]);
+            d->qvertices[a][i] = (uint16_t)MIN(MAX(q, 0.0f), 65535.0f);
+        }
+    }
+
+    free(d->vertices[0]);
+    for(int a = 0; a < 3; a++)
+        d->vertices[a] = NULL;
+
+    // The bvh gets built over the rounded vertices, so it
+    // bounds what the raytracer actually sees
+    build_mesh_bvh(m);
+    if(d->bvh.wide.node_count == 0)
+        bvh_collapse(&d->bvh, 4);
+    before += tree = bvh_memory(&d->bvh);
+    bvh_quantize(&d->bvh);
+
+    vertices = 3 * d->vertex_count * sizeof(uint16_t);
+    after = vertices + 3 * d->triangle_count * sizeof(uint32_t) + bvh_memory(&d->bvh);
+    inf(
+        "mesh compressed from %.2f MB to %.2f MB (vertices %.2f MB, bvh %.2f MB -> %.2f MB)",
+        before / 1048576.0, after / 1048576.0, vertices / 1048576.0,
+        tree / 1048576.0, bvh_memory(&d->bvh) / 1048576.0
+    );
+}
+
+// Saves the triangle (a, b, c) as triangle i of m
+void
+set_mesh_triangle(struct mesh_t *m, size_t i, struct pv_t *a, struct pv_t *b, struct pv_t *c)
+{
+    struct mesh_data_t *d = m->data;
+    struct pv_t e1, e2, n;
+
+    substract_pv(b, a, &e1);
+    substract_pv(c, a, &e2);
+    cross_pv(&e1, &e2, &n);
+    normalize_pv(&n, &n);
+
+    d->v0[0][i] = a->x; d->v0[1][i] = a->y; d->v0[2][i] = a->z;
+    d->e1[0][i] = e1.x; d->e1[1][i] = e1.y; d->e1[2][i] = e1.z;
+    d->e2[0][i] = e2.x; d->e2[1][i] = e2.y; d->e2[2][i] = e2.z;
+    d->n[0][i] = n.x; d->n[1][i] = n.y; d->n[2][i] = n.z;
+}
+
+// Moves every triangle of s by t, and saves them on r
+// (which can be s too)
+static void
+transform_triangles(struct mesh_data_t *s, matrix_t t, struct mesh_data_t *r)
+{
+    struct vertex_job_t normals = {.fn = normal_job};
+
+    // Indexed meshes only need to move each vertex once
+    if(s->faces != NULL)
+    {
+        transform_vertices(t, 1.0f, s->vertices, r->vertices, s->vertex_count);
+        if(r->faces != s->faces)
+            memcpy(r->faces, s->faces, 3 * s->triangle_count * sizeof(uint32_t));
+        return;
+    }
+
+    transform_vertices(t, 1.0f, s->v0, r->v0, s->triangle_count);
+    transform_vertices(t, 0.0f, s->e1, r->e1, s->triangle_count);
+    transform_vertices(t, 0.0f, s->e2, r->e2, s->triangle_count);
+
+    memcpy(normals.src, r->e1, sizeof(normals.src));
+    memcpy(normals.src2, r->e2, sizeof(normals.src2));
+    memcpy(normals.dst, r->n, sizeof(normals.dst));
+    run_vertex_jobs(&normals, s->triangle_count);
+}
+
+// Puts the triangles of d in the same order as the leaves of its
+// bvh, so leaves can go through them without the indirection
+static void
+sort_triangles(struct mesh_data_t *d)
+{
+    float *old = d->v0[0], *src[12], *dst[12];
+    uint32_t *indices = d->bvh.indices, *faces = NULL;
+
+    // Indexed meshes just need their faces moved around
+    if(d->faces != NULL)
+    {
+        faces = (uint32_t *)malloc(3 * d->triangle_count * sizeof(uint32_t));
+        for(size_t i = 0; i < d->triangle_count; i++)
+        {
+            memcpy(&faces[3 * i], &d->faces[3 * indices[i]], 3 * sizeof(uint32_t));
+            indices[i] = i;
+        }
+
+        free(d->faces);
+        d->faces = faces;
+        return;
+    }
+
+    for(int a = 0; a < 3; a++)
+    {
+        src[a] = d->v0[a]; src[3 + a] = d->e1[a];
+        src[6 + a] = d->e2[a]; src[9 + a] = d->n[a];
+    }
+
+    alloc_triangles(d, d->triangle_count);
+    for(int a = 0; a < 3; a++)
+    {
+        dst[a] = d->v0[a]; dst[3 + a] = d->e1[a];
+        dst[6 + a] = d->e2[a]; dst[9 + a] = d->n[a];
+    }
+
+    for(int c = 0; c < 12; c++)
+        for(size_t i = 0; i < d->triangle_count; i++)
+            dst[c][i] = src[c][indices[i]];
+
+    for(size_t i = 0; i < d->triangle_count; i++)
+        indices[i] = i;
+
+    free(old);
+}
+
+// Makes r another placement of the triangles of m, starting
+// wherever m is. r keeps its own material. Triangles aren't
+// copied, so m needs to stay an instance for as long as they
+// share them
+void
+instance_mesh(struct mesh_t *m, struct mesh_t *r)
+{
+    void *param = r->param;
+
+    *r = *m;
+    r->param = param;
+    r->data->refs++;
+}
+
 void 
 free_mesh(struct mesh_t *m)
 {
-    if(m->triangles != NULL)
-        free(m->triangles);
-        
-    m->triangles = NULL;
-    m->triangle_count = 0;
+    if(m->data != NULL && --m->data->refs <= 0)
+    {
+        free(m->data->v0[0]);
+        free(m->data->vertices[0]);
+        free(m->data->qvertices[0]);
+        free(m->data->faces);
+        bvh_free(&m->data->bvh);
+        free(m->data);
+    }
+
+    m->data = NULL;
+}
+
+// (Re)builds the bvh over the triangles of m. Meshes on
+// MESH_UPDATE_REFIT only get their bounds updated, unless
+// that made the tree too much worse
+void
+build_mesh_bvh(struct mesh_t *m)
+{
+    struct mesh_data_t *d = m->data;
+    struct aabb_t *boxes = NULL;
+    double start = time_ms();
+    float cost = 0.0f, v0 = 0.0f, v1 = 0.0f, v2 = 0.0f;
+
+    boxes = (struct aabb_t *)malloc(d->triangle_count * sizeof(struct aabb_t));
+    for(size_t i = 0; i < d->triangle_count; i++)
+    {
+        for(int a = 0; a < 3; a++)
+        {
+            if(d->faces != NULL)
+            {
+                v0 = mesh_vertex(d, a, d->faces[3 * i]);
+                v1 = mesh_vertex(d, a, d->faces[3 * i + 1]);
+                v2 = mesh_vertex(d, a, d->faces[3 * i + 2]);
+            }
+            else
+            {
+                v0 = d->v0[a][i];
+                v1 = v0 + d->e1[a][i];
+                v2 = v0 + d->e2[a][i];
+            }
+            boxes[i].min[a] = MIN(v0, MIN(v1, v2));
+            boxes[i].max[a] = MAX(v0, MAX(v1, v2));
+        }
+    }
+
+    if(m->update == MESH_UPDATE_REFIT && d->bvh.node_count > 0 && d->bvh.index_count == d->triangle_count)
+    {
+        cost = bvh_refit(&d->bvh, boxes);
+        if(cost <= d->bvh.build_cost * BVH_REFIT_MAX_GROWTH)
+        {
+            bvh_collapse(&d->bvh, bvh_wide_width());
+            free(boxes);
+
+            inf(
+                "bvh refitted in %.2f ms (%zu triangles, cost %.2fx of the built one)",
+                time_ms() - start, d->triangle_count, cost / d->bvh.build_cost
+            );
+            return;
+        }
+
+        inf("refitted bvh got %.2fx worse, rebuilding", cost / d->bvh.build_cost);
+    }
+
+    if(m->update == MESH_UPDATE_LBVH)
+        bvh_build_lbvh(&d->bvh, boxes, d->triangle_count);
+    else
+        bvh_build(&d->bvh, boxes, d->triangle_count);
+    sort_triangles(d);
+    bvh_collapse(&d->bvh, bvh_wide_width());
+    free(boxes);
+
+    inf(
+        "%s bvh built in %.2f ms (%zu triangles, %zu nodes, %zu %d-wide nodes)",
+        m->update == MESH_UPDATE_LBVH ? "linear" : "sah", time_ms() - start,
+        d->triangle_count, d->bvh.node_count, d->bvh.wide.node_count, d->bvh.wide.width
+    );
+}
+
+// World space bounds of m
+void
+mesh_bounds(struct mesh_t *m, struct aabb_t *b)
+{
+    struct aabb_t *o = &m->data->bvh.nodes[0].bounds;
+    struct pv_t corner;
+
+    if(m->update != MESH_UPDATE_INSTANCE)
+    {
+        *b = *o;
+        return;
+    }
+
+    // Bounds of the object space bounds, once moved
+    aabb_empty(b);
+    for(int i = 0; i < 8; i++)
+    {
+        corner = PV(
+            (i & 1) ? o->max[0] : o->min[0],
+            (i & 2) ? o->max[1] : o->min[1],
+            (i & 4) ? o->max[2] : o->min[2]
+        );
+        transform_pv(m->transform, &corner, &corner);
+        aabb_grow(b, (float []){corner.x, corner.y, corner.z});
+    }
+}
+
+static bool
+is_identity(matrix_t m)
+{
+    for(int i = 0; i < 4; i++)
+        for(int j = 0; j < 4; j++)
+            if(m[i][j] != (i == j ? 1.0f : 0.0f))
+                return false;
+
+    return true;
+}
+
+// Changes how m gets updated from now on. Instances that get
+// switched to anything else have their transform baked first
+void
+set_mesh_update(struct mesh_t *m, enum mesh_update_t update)
+{
+    matrix_t i;
+    bool bake = false;
+
+    // Compressed triangles can't be moved
+    if(m->data->qvertices[0] != NULL && update != MESH_UPDATE_INSTANCE)
+    {
+        wrn("compressed meshes can only be instances");
+        return;
+    }
+
+    bake = m->update == MESH_UPDATE_INSTANCE && update != MESH_UPDATE_INSTANCE && !is_identity(m->transform);
+    m->update = update;
+    if(!bake)
+        return;
+
+    transform_triangles(m->data, m->transform, m->data);
+
+    make_identity_matrix(i);
+    copy_matrix(i, m->transform);
+    copy_matrix(i, m->inv_transform);
+
+    build_mesh_bvh(m);
 }
 
 void 
 transform_mesh(struct mesh_t *m, matrix_t t, struct mesh_t *r)
 {
-    size_t i = 0;
     matrix_t b;
 
-    for(; i < m->triangle_count; i++)
-        transform_triangle(&m->triangles[i], t, &r->triangles[i]);
+    // Instances only need their transform updated
+    if(r->update == MESH_UPDATE_INSTANCE)
+    {
+        mxm(t, m->transform, b);
+        inv_matrix(b, r->inv_transform);
+        copy_matrix(b, r->transform);
+
+        // Someone else's triangles get shared, not copied over
+        // r's own, which other meshes could be using too
+        if(r->data != m->data)
+        {
+            m->data->refs++;
+            free_mesh(r);
+            r->data = m->data;
+            r->bounding_sphere = m->bounding_sphere;
+            r->has_bounding_sphere = m->has_bounding_sphere;
+        }
+        return;
+    }
 
-    mxm(t, m->transform, b);
-    inv_matrix(b, r->inv_transform);
-    copy_matrix(b, r->transform);
+    transform_triangles(m->data, t, r->data);
+    build_mesh_bvh(r);
 }
 
 void transform_object(struct gobject_t *g, matrix_t t, struct gobject_t *r)
@@ -659,9 +1059,9 @@ new_rectangle_mesh(struct pv_t *a, struct pv_t *b, struct pv_t *c, struct pv_t *
     struct pv_t p = {0};
 
     new_mesh(m, 2);
-    make_triangle(a, b, c, &m->triangles[0]);
-    make_triangle(c, d, a, &m->triangles[1]);
-    m->triangles[0].single_sided = m->triangles[1].single_sided = false;
+    set_mesh_triangle(m, 0, a, b, c);
+    set_mesh_triangle(m, 1, c, d, a);
+    build_mesh_bvh(m);
 
     m->has_bounding_sphere = true;
 
@@ -683,11 +1083,10 @@ new_rectangle_mesh_wh(float width, float height, struct mesh_t *m)
 
     a.x = width;
     c.z = -height;
-    make_triangle(&b, &a, &c, &m->triangles[0]);
+    set_mesh_triangle(m, 0, &b, &a, &c);
 
     b.z = c.z;
     b.x = a.x;
-    make_triangle(&a, &b, &c, &m->triangles[1]);
-
-    m->triangles[0].single_sided = m->triangles[1].single_sided = false;
+    set_mesh_triangle(m, 1, &a, &b, &c);
+    build_mesh_bvh(m);
 }
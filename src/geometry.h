@@ -8,6 +8,9 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "bvh.h"
+#include "vecmath.h"
+
 #ifndef M_PI
 #define	M_PI		                ((double)3.14159265358979323846)
 #endif
@@ -25,17 +28,16 @@
 #define PLANE(c, n)                 (struct gobject_t){.type = GEOMETRY_PLANE, .center = c, .normal = n}
 #define TRIANGLE(a, b, c, n)        (struct gobject_t){.type = GEOMETRY_TRIANGLE, .edges[0] = a, .edges[1] = b, .edges[2] = c, .normal = n}
 
+// Vertex arrays at least this long get transformed by
+// several threads at once
+#define GEOMETRY_PARALLEL_THRESHOLD 65536
+#define GEOMETRY_MAX_THREADS        64
+
 #define MIN(a,b)                    (((a)<(b))?(a):(b))
 #define MAX(a,b)                    (((a)>(b))?(a):(b))
 
 typedef uint32_t pixel_t;
 
-typedef float matrix_t[4][4];
-typedef float column_t[4][1];
-
-struct pv_t
-{ float x,y,z,w; };
-
 enum gobject_type_t
 {
     GEOMETRY_TRIANGLE,
@@ -74,14 +76,89 @@ struct gobject_t
 #define sphere_t gobject_t
 #define plane_t gobject_t
 
-struct mesh_t
+// How a mesh gets moved around by transform_mesh
+enum mesh_update_t
 {
-    struct triangle_t *triangles;
+    // Triangles stay where they are (object space) and only the
+    // transform of the mesh changes. Rays get moved into object
+    // space instead, so the bvh never needs to be touched
+    MESH_UPDATE_INSTANCE,
+
+    // Everything else bakes the transform into the triangles,
+    // and then updates the bvh:
+    // Slow, but makes the best trees
+    MESH_UPDATE_SAH,
+    // Linear bvh, a lot faster to build
+    MESH_UPDATE_LBVH,
+    // Keep the same tree and just update its bounds, with a
+    // SAH rebuild once they get too loose
+    MESH_UPDATE_REFIT,
+};
+
+// Triangles of a mesh, and the bvh over them. Any number of meshes
+// can share the same data, each one placing it somewhere else
+struct mesh_data_t
+{
+    // Triangles are kept as one array per component (x, y, z) of their
+    // first vertex (v0), the edges to the other two (e1 = v1 - v0 and
+    // e2 = v2 - v0) and their normal. That's 48 bytes per triangle, and
+    // lets the raytracer go through them like any other float array.
+    // They're sorted in the same order as the leaves of bvh, so a leaf
+    // is always a contiguous run of triangles
+    float *v0[3], *e1[3], *e2[3], *n[3];
     size_t triangle_count;
+
+    // Indexed meshes keep every vertex once on vertices (again one
+    // array per component) and their triangles as 3 indices into it
+    // on faces, sorted just like above. They don't use v0/e1/e2/n,
+    // and edges and normals are worked out when needed
+    float *vertices[3];
+    size_t vertex_count;
+    uint32_t *faces;
+
+    // Compressed indexed meshes (see compress_mesh) keep their vertices
+    // as 16 bit steps of qscale away from qmin here instead, and have
+    // vertices set to NULL. Use mesh_vertex to read them either way
+    uint16_t *qvertices[3];
+    float qmin[3], qscale[3];
+
+    // Single sided triangles can only be hit from the front
+    bool single_sided;
+
+    // Built over triangles, needs to be updated
+    // every time they change
+    struct bvh_t bvh;
+
+    // Meshes using this, it's freed once the last one is
+    int refs;
+};
+
+// Component a of vertex i of an indexed mesh
+static inline float
+mesh_vertex(const struct mesh_data_t *d, int a, uint32_t i)
+{
+    if(d->qvertices[a] != NULL)
+        return d->qmin[a] + (float)d->qvertices[a][i] * d->qscale[a];
+
+    return d->vertices[a][i];
+}
+
+struct mesh_t
+{
+    struct mesh_data_t *data;
+
+    // Object to world space (and back). Only meshes on
+    // MESH_UPDATE_INSTANCE ever have anything but the
+    // identity here, the rest have it baked into triangles
     matrix_t transform, inv_transform;
 
     struct gobject_t bounding_sphere;
     bool has_bounding_sphere;
+
+    enum mesh_update_t update;
+
+    // Material used by every triangle of the mesh
+    void *param;
 };
 
 const char* matrix_to_str(matrix_t m);
@@ -91,31 +168,21 @@ const char* pv_to_str(struct pv_t *p);
 void copy_matrix(matrix_t s, matrix_t d);
 void clear_matrix(matrix_t m);
 
-float magnitude_pv(struct pv_t *v);
-
-void reflect_pv(struct pv_t *i, struct pv_t *n, struct pv_t *r);
-void substract_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r);
-void add_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r);
-void scale_pv(struct pv_t * p, float s, struct pv_t *r);
-void divide_pv(struct pv_t *p, float s, struct pv_t *r);
-void multiply_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r);
-void normalize_pv(struct pv_t *v, struct pv_t *r);
 void inverse_pv(struct pv_t* p, struct pv_t *r);
-void cross_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r);
-float dot_product(struct pv_t *a, struct pv_t *b);
 
 void inv_matrix(matrix_t m, matrix_t r);
-void mxc(matrix_t m, column_t c, column_t r);
-void mxm(matrix_t m, matrix_t c, matrix_t r);
 
 void make_identity_matrix(matrix_t m);
 void make_translation_matrix(float x, float y, float z, matrix_t m);
 void make_scaling_matrix(float x, float y, float z, matrix_t m);
 void make_rotation_matrix(float t, struct pv_t *u, matrix_t m);
 
-void transform_pv(matrix_t m, struct pv_t *p, struct pv_t *r);
 void transform_pv_arr(matrix_t m, struct pv_t *src, struct pv_t *dst, size_t s);
 
+void geometry_set_pool(struct pool_t *pool);
+void transform_vertices(matrix_t m, float w, float *src[3], float *dst[3], size_t count);
+void load_vertices(const float *xyz, float *dst[3], size_t count);
+
 void make_triangle(struct pv_t *a, struct pv_t *b, struct pv_t *c, struct triangle_t *t);
 void transform_triangle(struct triangle_t *t, matrix_t m, struct triangle_t *r);
 
@@ -124,7 +191,18 @@ void make_sphere(struct pv_t *center, float radius, struct sphere_t *s);
 void make_plane(struct pv_t *center, struct pv_t *normal, struct plane_t * plane);
 
 void new_mesh(struct mesh_t *m, size_t c);
+void set_mesh_triangle(struct mesh_t *m, size_t i, struct pv_t *a, struct pv_t *b, struct pv_t *c);
+void new_indexed_mesh(struct mesh_t *m, size_t vertex_count, size_t face_count);
+void set_mesh_vertex(struct mesh_t *m, size_t i, struct pv_t *v);
+void set_mesh_vertices(struct mesh_t *m, const float *xyz);
+void set_mesh_face(struct mesh_t *m, size_t i, uint32_t a, uint32_t b, uint32_t c);
+void compress_mesh(struct mesh_t *m);
+
+void instance_mesh(struct mesh_t *m, struct mesh_t *r);
 void free_mesh(struct mesh_t *m);
+void build_mesh_bvh(struct mesh_t *m);
+void mesh_bounds(struct mesh_t *m, struct aabb_t *b);
+void set_mesh_update(struct mesh_t *m, enum mesh_update_t update);
 
 void transform_object(struct gobject_t *g, matrix_t t, struct gobject_t *r);
 void transform_mesh(struct mesh_t *m, matrix_t t, struct mesh_t *r);
@@ -1,10 +1,17 @@
 #include "utilities.h"
 
 #include "script.h"
+#include "raytracer.h"
 
 int 
 main(int argc, char const *argv[])
 {
-    script_run_file(argv[1]);
+    int threads = RAYTRACER_DEFAULT_THREADS;
+
+    // Optional: Number of threads to render with
+    if(argc > 2)
+        threads = atoi(argv[2]);
+
+    script_run_file(argv[1], threads);
     return 0;
 }
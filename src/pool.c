@@ -0,0 +1,270 @@
+#include "pool.h"
+
+struct pool_thread_t
+{
+    struct pool_t *pool;
+    int id;
+};
+
+// Takes the oldest task off the queue. Needs the lock
+static struct pool_task_t *
+pop_task(struct pool_t *pool)
+{
+    struct pool_task_t *task = pool->tasks;
+
+    pool->tasks = task->next;
+    pool->queued--;
+    task->state = POOL_TASK_RUNNING;
+
+    return task;
+}
+
+static void *
+pool_thread(void *arg)
+{
+    pool_fn_t fn;
+    void *fn_arg;
+    struct pool_task_t *task = NULL;
+    unsigned int seen = 0;
+    struct pool_thread_t *thread = (struct pool_thread_t *)arg;
+    struct pool_t *pool = thread->pool;
+    int id = thread->id;
+
+    free(thread);
+
+    // Generations start at 0 (see pool_init), so a job handed out
+    // before this thread got to run won't be missed
+    pthread_mutex_lock(&pool->lock);
+    while(true)
+    {
+        while(pool->generation == seen && pool->tasks == NULL && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+
+        if(pool->quit)
+            break;
+
+        // pool_run jobs go first, since whoever called it is
+        // waiting on every thread
+        if(pool->generation == seen)
+        {
+            task = pop_task(pool);
+            pthread_mutex_unlock(&pool->lock);
+
+            task->fn(task->arg);
+
+            pthread_mutex_lock(&pool->lock);
+            task->state = POOL_TASK_DONE;
+            pthread_cond_broadcast(&pool->task_done);
+            continue;
+        }
+
+        seen = pool->generation;
+        fn = pool->fn;
+        fn_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        fn(fn_arg, id);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+// Starts thread_count - 1 threads, since the thread calling
+// pool_run works as well. Returns the number of threads
+// (calling one included) the pool ended up with
+int
+pool_init(struct pool_t *pool, int thread_count)
+{
+    struct pool_thread_t *thread = NULL;
+
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_cond_init(&pool->task_done, NULL);
+
+    pool->thread_count = 1;
+    if(thread_count > 1)
+        pool->threads = (pthread_t *)calloc(thread_count - 1, sizeof(pthread_t));
+
+    for(int i = 1; pool->threads != NULL && i < thread_count; i++)
+    {
+        thread = (struct pool_thread_t *)malloc(sizeof(*thread));
+        *thread = (struct pool_thread_t){.pool = pool, .id = i};
+
+        if(pthread_create(&pool->threads[i - 1], NULL, pool_thread, thread) != 0)
+        {
+            free(thread);
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    return pool->thread_count;
+}
+
+void
+pool_destroy(struct pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->thread_count - 1; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+
+    pthread_cond_destroy(&pool->task_done);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+
+    pool->threads = NULL;
+    pool->thread_count = 0;
+}
+
+// Runs fn(arg, id) on every thread of the pool, where id goes
+// from 0 (the calling thread) to thread_count - 1
+void
+pool_run(struct pool_t *pool, pool_fn_t fn, void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->running = pool->thread_count - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    fn(arg, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while(pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Hands fn(arg) to the first idle thread. There's never more tasks
+// waiting than threads to take them, anything past that (or anything
+// at all on a single thread pool) is left for pool_wait to run. This
+// keeps recursive callers from piling up tasks nobody can get to
+void
+pool_submit(struct pool_t *pool, struct pool_task_t *task, pool_task_fn_t fn, void *arg)
+{
+    struct pool_task_t **last = NULL;
+
+    *task = (struct pool_task_t){.fn = fn, .arg = arg, .state = POOL_TASK_PENDING};
+    if(pool == NULL || pool->thread_count < 2)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->queued < pool->thread_count - 1)
+    {
+        last = &pool->tasks;
+        while(*last != NULL)
+            last = &(*last)->next;
+        *last = task;
+        pool->queued++;
+        task->state = POOL_TASK_QUEUED;
+        pthread_cond_signal(&pool->start);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for task to be done. If no thread got to it yet, it's taken
+// back and run right here, so this never waits on threads that are
+// busy with something else (like a pool_run job)
+void
+pool_wait(struct pool_t *pool, struct pool_task_t *task)
+{
+    struct pool_task_t **t = NULL;
+
+    if(task->state != POOL_TASK_PENDING)
+    {
+        pthread_mutex_lock(&pool->lock);
+        if(task->state == POOL_TASK_QUEUED)
+        {
+            t = &pool->tasks;
+            while(*t != task)
+                t = &(*t)->next;
+            *t = task->next;
+            pool->queued--;
+            task->state = POOL_TASK_PENDING;
+        }
+
+        while(task->state == POOL_TASK_RUNNING)
+            pthread_cond_wait(&pool->task_done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if(task->state == POOL_TASK_PENDING)
+    {
+        task->fn(task->arg);
+        task->state = POOL_TASK_DONE;
+    }
+}
+
+// Returns size bytes (aligned to 16) from s. If s needs to grow, everything
+// allocated since the last scratch_reset keeps living on the old block, which
+// is only freed on the next reset
+void *
+scratch_alloc(struct scratch_t *s, size_t size)
+{
+    void *p = NULL;
+    size_t needed = 0;
+
+    size = (size + 15) & ~(size_t)15;
+    if(s->used + size > s->reserved)
+    {
+        // Chain the old block behind the new one, so it stays valid
+        needed = s->reserved * 2 > s->used + size + 16 ? s->reserved * 2 : s->used + size + 16;
+        p = malloc(needed);
+        *(void **)p = s->data;
+
+        s->data = (unsigned char *)p;
+        s->reserved = needed;
+        s->used = 16;
+    }
+
+    p = &s->data[s->used];
+    s->used += size;
+
+    return p;
+}
+
+void
+scratch_reset(struct scratch_t *s)
+{
+    void *old = NULL, *next = NULL;
+
+    if(s->data == NULL)
+        return;
+
+    // Only keep the newest (biggest) block
+    old = *(void **)s->data;
+    while(old != NULL)
+    {
+        next = *(void **)old;
+        free(old);
+        old = next;
+    }
+
+    *(void **)s->data = NULL;
+    s->used = 16;
+}
+
+void
+scratch_free(struct scratch_t *s)
+{
+    scratch_reset(s);
+    free(s->data);
+
+    s->data = NULL;
+    s->used = s->reserved = 0;
+}
@@ -0,0 +1,78 @@
+#ifndef POOL_H__
+#define POOL_H__
+
+#include <pthread.h>
+
+#include "utilities.h"
+
+typedef void (*pool_fn_t)(void *arg, int id);
+typedef void (*pool_task_fn_t)(void *arg);
+
+enum pool_task_state_t
+{
+    // Left for pool_wait to run
+    POOL_TASK_PENDING,
+    POOL_TASK_QUEUED,
+    POOL_TASK_RUNNING,
+    POOL_TASK_DONE
+};
+
+// A single piece of work handed to the pool by pool_submit. It
+// lives wherever the caller puts it, and has to stay there until
+// pool_wait returns
+struct pool_task_t
+{
+    pool_task_fn_t fn;
+    void *arg;
+
+    enum pool_task_state_t state;
+    struct pool_task_t *next;
+};
+
+// A set of threads that stay alive between jobs. pool_run
+// hands the same function to every thread (the calling
+// one included) and waits for all of them to return. Idle
+// threads also pick up tasks from pool_submit
+struct pool_t
+{
+    pthread_t *threads;
+    int thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, done, task_done;
+
+    // Tasks nobody has picked up yet, oldest first
+    struct pool_task_t *tasks;
+    int queued;
+
+    pool_fn_t fn;
+    void *arg;
+
+    unsigned int generation;
+    int running;
+    bool quit;
+};
+
+// Bump allocator for memory a thread only needs for a little
+// while. Everything handed out is released at once by
+// scratch_reset, but the memory itself is kept around for
+// the next time
+struct scratch_t
+{
+    unsigned char *data;
+    size_t used, reserved;
+};
+
+int pool_init(struct pool_t *pool, int thread_count);
+void pool_destroy(struct pool_t *pool);
+
+void pool_run(struct pool_t *pool, pool_fn_t fn, void *arg);
+
+void pool_submit(struct pool_t *pool, struct pool_task_t *task, pool_task_fn_t fn, void *arg);
+void pool_wait(struct pool_t *pool, struct pool_task_t *task);
+
+void *scratch_alloc(struct scratch_t *s, size_t size);
+void scratch_reset(struct scratch_t *s);
+void scratch_free(struct scratch_t *s);
+
+#endif
@@ -1,13 +1,37 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "raytracer.h"
 #include "fmath.h"
 
 #include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+// Packets get their lanes tested 4 at a time with SSE on x86,
+// and one by one everywhere else
+#if !defined(RAYTRACER_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RAYTRACER_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #define SMALL_F         0.000000001
 
+// Triangles on a mesh leaf get tested this many at a time
+#define TRIANGLE_BATCH  8
+
+// Same for planes
+#define PLANE_BATCH     8
+
+// Packets that get down to this many rays on some node
+// of a mesh finish that node one ray at a time
+#define PACKET_MIN_RAYS 2
+
 struct ray_t
 {
     struct pv_t orig, dir, inv_dir;
+    // 1/dir, used to intersect bounding boxes
+    struct pv_t rcp_dir;
     short dir_sign[3];
     bool primary_ray;
 
@@ -24,6 +48,24 @@ struct hit_info_t
 
     struct pv_t normal, hit_point;
     struct gobject_t* object;
+
+    // Material of whatever got hit. Triangles of a mesh
+    // use the one of the mesh
+    void *param;
+};
+
+// All closest_hit keeps of the closest hit so far (besides its t),
+// which is just enough to find what got hit again. hit_attributes
+// fills a hit_info_t out of it, once, for the one that ends up closest
+struct hit_t
+{
+    // Scene ref (see SCENE_REF_*). Spheres are their slot on the
+    // scene's sphere list, and planes the object they came from
+    uint32_t ref;
+    // Triangle of the mesh, for mesh refs
+    uint32_t prim;
+    // Barycentrics of the triangle's B and C
+    float u, v;
 };
 
 static void
@@ -33,13 +75,13 @@ make_ray(struct pv_t *orig, struct pv_t *dir, struct ray_t *r)
     r->orig.w = 1.0;
     normalize_pv(dir, &r->dir);
     scale_pv(dir, -1.0, &r->inv_dir);
+    inverse_pv(&r->dir, &r->rcp_dir);
+    r->dir_sign[0] = (r->rcp_dir.x < 0);
+    r->dir_sign[1] = (r->rcp_dir.y < 0);
+    r->dir_sign[2] = (r->rcp_dir.z < 0);
     r->indirect = false;
     r->depth = 0;
     r->primary_ray = false;
-    /* inverse_pv(dir, &r->inv_dir); */
-    /* r->dir_sign[0] = (r->inv_dir.x < 0); */
-    /* r->dir_sign[1] = (r->inv_dir.y < 0); */
-    /* r->dir_sign[2] = (r->inv_dir.z < 0); */
 }
 
 static struct raytracer_opts_t
@@ -48,12 +90,24 @@ DEFAULT_OPTS =
     .fov    = RAYTRACER_DEFAULT_FOV,
     .aa     = 0,
 
-    .depth  = RAYTRACER_DEFAULT_DEPTH
+    .depth  = RAYTRACER_DEFAULT_DEPTH,
+
+    .sampler = RAYTRACER_DEFAULT_SAMPLER,
+
+    .packet_size = RAYTRACER_DEFAULT_PACKET_SIZE
 };
 
 static struct gparams_t
 DEFAULT_OBJECT_PARAMS = {0};
 
+// Rays traced by the current thread, gets added to the
+// frame's stats once the thread runs out of tiles
+static _Thread_local size_t rays_traced = 0;
+
+// Sample the current thread is working on. Everything random
+// about it comes from here (see seed_sample)
+static _Thread_local struct sampler_t sampler;
+
 static void
 ray_intersect_point(struct ray_t *r, float t, struct pv_t *v)
 {
@@ -63,6 +117,66 @@ ray_intersect_point(struct ray_t *r, float t, struct pv_t *v)
     v->w = 1.0;
 }
 
+// Moller-Trumbore against a single triangle, with the edges make_triangle
+// already worked out (ba and ac, which goes the other way around). Bails
+// out as soon as the hit can't be before t_max, and leaves everything
+// but the barycentrics of B and C (u and v) to triangle_hit_info, so
+// only the closest hit pays for it. Returns -1.0 on a miss
+static inline float
+intersect_triangle(const struct ray_t *ray, const struct gobject_t *tri, float t_max, float *u, float *v)
+{
+    const struct pv_t *e1 = &tri->ba, *o = &tri->edges[0], *d = &ray->dir;
+    const struct pv_t e2 = {-tri->ac.x, -tri->ac.y, -tri->ac.z, 0.0f};
+    float px, py, pz, qx, qy, qz, sx, sy, sz, det, inv, t;
+
+    // p = dir x e2
+    px = d->y * e2.z - d->z * e2.y;
+    py = d->z * e2.x - d->x * e2.z;
+    pz = d->x * e2.y - d->y * e2.x;
+
+    // Front facing triangles have a positive determinant
+    det = e1->x * px + e1->y * py + e1->z * pz;
+    if((tri->single_sided ? det : fabsf(det)) <= SMALL_F)
+        return -1.0;
+    inv = 1.0f / det;
+
+    sx = ray->orig.x - o->x;
+    sy = ray->orig.y - o->y;
+    sz = ray->orig.z - o->z;
+    *u = (sx * px + sy * py + sz * pz) * inv;
+    if(*u < 0.0f || *u > 1.0f)
+        return -1.0;
+
+    // q = s x e1
+    qx = sy * e1->z - sz * e1->y;
+    qy = sz * e1->x - sx * e1->z;
+    qz = sx * e1->y - sy * e1->x;
+
+    // Checking t before v skips the rest for whatever is behind
+    // the closest hit so far
+    t = (e2.x * qx + e2.y * qy + e2.z * qz) * inv;
+    if(t <= 0.0f || t >= t_max)
+        return -1.0;
+
+    *v = (d->x * qx + d->y * qy + d->z * qz) * inv;
+    if(*v < 0.0f || *u + *v > 1.0f)
+        return -1.0;
+
+    return t;
+}
+
+// Rest of the info of a hit found by intersect_triangle
+static inline void
+triangle_hit_info(struct ray_t *ray, struct gobject_t *tri, float t, float u, float v, struct hit_info_t *info)
+{
+    info->u = 1.0f - u - v;
+    info->v = u;
+    info->w = v;
+    info->normal = tri->normal;
+    info->object = tri;
+    ray_intersect_point(ray, t, &info->hit_point);
+}
+
 static float
 ray_intersect(struct ray_t *ray, struct gobject_t *object, struct hit_info_t *info)
 {
@@ -110,87 +224,1377 @@ ray_intersect(struct ray_t *ray, struct gobject_t *object, struct hit_info_t *in
             // add_pv(&pv, orig, &pv);
             break;
 
-        case GEOMETRY_DISK:
-        case GEOMETRY_PLANE:
-            normal_dot_dir = dot_product(&object->normal, dir);
-            if(fabs(normal_dot_dir) < SMALL_F)
-                return -1.0;
-            
-            substract_pv(&object->center, orig, &pv);
-            t0 = dot_product(&pv, &object->normal)/dot_product(dir, &object->normal);
-            if(t0 < 0.0)
-                return t0;
-            
-            info->normal = object->normal;
-            info->object = object;
-            ray_intersect_point(ray, t0, &info->hit_point);
-            pv = info->hit_point;
+        case GEOMETRY_DISK:
+        case GEOMETRY_PLANE:
+            normal_dot_dir = dot_product(&object->normal, dir);
+            if(fabs(normal_dot_dir) < SMALL_F)
+                return -1.0;
+            
+            substract_pv(&object->center, orig, &pv);
+            t0 = dot_product(&pv, &object->normal)/dot_product(dir, &object->normal);
+            if(t0 < 0.0)
+                return t0;
+            
+            info->normal = object->normal;
+            info->object = object;
+            ray_intersect_point(ray, t0, &info->hit_point);
+            pv = info->hit_point;
+
+            // Only go further if the object is a disk
+            if(object->type == GEOMETRY_PLANE)
+                break;
+
+            // Get the radious of the intersct point
+            if(magnitude_pv(&pv) > object->radius)
+                return -1.0;
+            return t0;
+            break;
+        case GEOMETRY_TRIANGLE:
+            t0 = intersect_triangle(ray, object, INFINITY, &a, &b);
+            if(t0 < 0.0)
+                return t0;
+
+            triangle_hit_info(ray, object, t0, a, b, info);
+            break;
+        default:
+            break;
+    }
+    
+    return t0;
+}
+
+// Slab test. Returns true if ray goes through b somewhere
+// before t_max, and saves where it enters b on t_near
+static inline bool
+ray_intersect_box(struct ray_t *ray, const struct aabb_t *b, float t_max, float *t_near)
+{
+    float t0 = 0.0, t1 = t_max, tn = 0.0, tf = 0.0;
+    const float orig[3] = {ray->orig.x, ray->orig.y, ray->orig.z};
+    const float rcp[3] = {ray->rcp_dir.x, ray->rcp_dir.y, ray->rcp_dir.z};
+
+    for(int a = 0; a < 3; a++)
+    {
+        tn = (b->min[a] - orig[a]) * rcp[a];
+        tf = (b->max[a] - orig[a]) * rcp[a];
+        if(tn > tf)
+            SWAP(tn, tf, float);
+
+        // Written like this so NaNs (0 * inf) don't shrink the interval
+        t0 = tn > t0 ? tn : t0;
+        t1 = tf < t1 ? tf : t1;
+        if(t0 > t1)
+            return false;
+    }
+
+    *t_near = t0;
+    return true;
+}
+
+// Nodes left to visit while walking down a bvh, along with
+// where the ray enters them
+struct bvh_stack_t
+{
+    struct
+    {
+        uint32_t node;
+        float t_near;
+    } entries[BVH_MAX_DEPTH];
+    size_t sp;
+};
+
+static inline void
+bvh_stack_init(struct ray_t *ray, struct bvh_t *bvh, struct bvh_stack_t *stack, float t)
+{
+    float t_near = 0.0;
+
+    stack->sp = 0;
+    if(bvh->node_count > 0 && ray_intersect_box(ray, &bvh->nodes[0].bounds, t, &t_near))
+    {
+        stack->entries[0].node = 0;
+        stack->entries[0].t_near = t_near;
+        stack->sp = 1;
+    }
+}
+
+// Returns the next leaf of the bvh ray goes through, or NULL if there
+// are none left. Children are visited nearest first, and anything
+// that starts past t (the closest hit found so far) is skipped
+static inline struct bvh_node_t *
+bvh_next_leaf(struct ray_t *ray, struct bvh_node_t *nodes, struct bvh_stack_t *stack, float t)
+{
+    float t_left = 0.0, t_right = 0.0;
+    bool hit_left = false, hit_right = false;
+    struct bvh_node_t *node = NULL, *left = NULL, *right = NULL;
+
+    while(stack->sp > 0)
+    {
+        stack->sp--;
+        if(stack->entries[stack->sp].t_near >= t)
+            continue;
+
+        node = &nodes[stack->entries[stack->sp].node];
+        while(node != NULL && node->count == 0)
+        {
+            left = &nodes[node->first];
+            right = left + 1;
+            hit_left = ray_intersect_box(ray, &left->bounds, t, &t_left);
+            hit_right = ray_intersect_box(ray, &right->bounds, t, &t_right);
+
+            if(hit_left && hit_right)
+            {
+                // Go for the closest one, and leave the other one for later
+                if(t_left <= t_right)
+                {
+                    stack->entries[stack->sp].node = right - nodes;
+                    stack->entries[stack->sp++].t_near = t_right;
+                    node = left;
+                }
+                else
+                {
+                    stack->entries[stack->sp].node = left - nodes;
+                    stack->entries[stack->sp++].t_near = t_left;
+                    node = right;
+                }
+            }
+            else if(hit_left)
+                node = left;
+            else if(hit_right)
+                node = right;
+            else
+                node = NULL;
+        }
+
+        if(node != NULL)
+            return node;
+    }
+
+    return NULL;
+}
+
+// Same as bvh_stack_t, but for wide bvhs. Leaves get pushed
+// too, so they can be visited in order with everything else
+struct bvh_wide_stack_t
+{
+    struct
+    {
+        uint32_t child, count;
+        float t_near;
+    } entries[BVH_MAX_DEPTH * BVH_WIDE_MAX];
+    size_t sp;
+};
+
+static inline void
+bvh_wide_stack_init(struct ray_t *ray, struct bvh_t *bvh, struct bvh_wide_stack_t *stack, float t)
+{
+    float t_near = 0.0;
+
+    stack->sp = 0;
+    if(bvh->wide.node_count > 0 && ray_intersect_box(ray, &bvh->nodes[0].bounds, t, &t_near))
+    {
+        stack->entries[0].child = 0;
+        stack->entries[0].count = 0;
+        stack->entries[0].t_near = t_near;
+        stack->sp = 1;
+    }
+}
+
+// Wide version of bvh_next_leaf. Saves the primitives on the
+// leaf on first and count instead of returning the leaf
+static inline bool
+bvh_wide_next_leaf(struct ray_t *ray, struct bvh_wide_t *wide, struct bvh_wide_stack_t *stack, float t, uint32_t *first, uint32_t *count)
+{
+    int mask = 0, hits = 0, order[BVH_WIDE_MAX];
+    uint32_t node = 0, lane = 0;
+    float t_near[BVH_WIDE_MAX];
+    const float orig[3] = {ray->orig.x, ray->orig.y, ray->orig.z};
+    const float rcp[3] = {ray->rcp_dir.x, ray->rcp_dir.y, ray->rcp_dir.z};
+
+    while(stack->sp > 0)
+    {
+        stack->sp--;
+        if(stack->entries[stack->sp].t_near >= t)
+            continue;
+
+        if(stack->entries[stack->sp].count > 0)
+        {
+            *first = stack->entries[stack->sp].child;
+            *count = stack->entries[stack->sp].count;
+            return true;
+        }
+
+        node = stack->entries[stack->sp].child;
+        mask = bvh_wide_intersect(wide, node, orig, rcp, ray->dir_sign, t, t_near);
+
+        // Sort whatever got hit from far to near, so the nearest
+        // one ends up on top of the stack
+        for(hits = 0; mask != 0; mask &= mask - 1)
+        {
+            int i = hits++, c = __builtin_ctz(mask);
+            for(; i > 0 && t_near[order[i - 1]] < t_near[c]; i--)
+                order[i] = order[i - 1];
+            order[i] = c;
+        }
+
+        for(int i = 0; i < hits; i++)
+        {
+            lane = node * wide->width + order[i];
+            stack->entries[stack->sp].child = wide->child[lane];
+            stack->entries[stack->sp].count = wide->count[lane];
+            stack->entries[stack->sp++].t_near = t_near[order[i]];
+        }
+    }
+
+    return false;
+}
+
+// Moves ray by m. Directions aren't normalized again, so
+// distances along r are the same as along ray
+static void
+transform_ray(struct ray_t *ray, matrix_t m, struct ray_t *r)
+{
+    struct pv_t dir = ray->dir;
+
+    *r = *ray;
+    transform_pv(m, &ray->orig, &r->orig);
+
+    dir.w = 0.0;
+    transform_pv(m, &dir, &r->dir);
+
+    inverse_pv(&r->dir, &r->rcp_dir);
+    r->dir_sign[0] = (r->rcp_dir.x < 0);
+    r->dir_sign[1] = (r->rcp_dir.y < 0);
+    r->dir_sign[2] = (r->rcp_dir.z < 0);
+}
+
+// Edges and first vertices of some triangles, one array per component
+struct triangle_batch_t
+{
+    const float *v0[3], *e1[3], *e2[3];
+};
+
+// Moller-Trumbore against triangles [first, first + count) of tb, all
+// of them at once. Saves how far along ray each one got hit on t
+// (INFINITY if it wasn't), and the barycentrics of those hits on u
+// and v. There are no branches in here so the loop can be vectorized
+static inline void
+intersect_triangles(const struct ray_t *ray, const struct triangle_batch_t *d, bool single_sided, uint32_t first, uint32_t count, float *t, float *u, float *v)
+{
+    const float ox = ray->orig.x, oy = ray->orig.y, oz = ray->orig.z;
+    const float dx = ray->dir.x, dy = ray->dir.y, dz = ray->dir.z;
+    float px, py, pz, qx, qy, qz, sx, sy, sz, det, inv, tu, tv, tt;
+    uint32_t i = 0;
+    bool hit = false;
+
+    for(uint32_t j = 0; j < count; j++)
+    {
+        i = first + j;
+
+        // p = dir x e2
+        px = dy * d->e2[2][i] - dz * d->e2[1][i];
+        py = dz * d->e2[0][i] - dx * d->e2[2][i];
+        pz = dx * d->e2[1][i] - dy * d->e2[0][i];
+
+        // Front facing triangles have a positive determinant
+        det = d->e1[0][i] * px + d->e1[1][i] * py + d->e1[2][i] * pz;
+        inv = 1.0f / det;
+
+        sx = ox - d->v0[0][i];
+        sy = oy - d->v0[1][i];
+        sz = oz - d->v0[2][i];
+        tu = (sx * px + sy * py + sz * pz) * inv;
+
+        // q = s x e1
+        qx = sy * d->e1[2][i] - sz * d->e1[1][i];
+        qy = sz * d->e1[0][i] - sx * d->e1[2][i];
+        qz = sx * d->e1[1][i] - sy * d->e1[0][i];
+        tv = (dx * qx + dy * qy + dz * qz) * inv;
+        tt = (d->e2[0][i] * qx + d->e2[1][i] * qy + d->e2[2][i] * qz) * inv;
+
+        hit = ((single_sided ? det : fabsf(det)) > SMALL_F) &
+            (tu >= 0.0f) & (tv >= 0.0f) & (tu + tv <= 1.0f) & (tt > 0.0f);
+
+        t[j] = hit ? tt : INFINITY;
+        u[j] = tu;
+        v[j] = tv;
+    }
+}
+
+// Indexed meshes don't keep their edges around, so this works them
+// out for triangles [first, first + count) of d onto the arrays of g,
+// and points tb at them
+static inline void
+gather_triangles(const struct mesh_data_t *d, uint32_t first, uint32_t count, float g[9][TRIANGLE_BATCH], struct triangle_batch_t *tb)
+{
+    const uint32_t *f = NULL;
+
+    for(int a = 0; a < 3; a++)
+    {
+        for(uint32_t j = 0; j < count; j++)
+        {
+            f = &d->faces[3 * (first + j)];
+            g[a][j] = mesh_vertex(d, a, f[0]);
+            g[3 + a][j] = mesh_vertex(d, a, f[1]) - g[a][j];
+            g[6 + a][j] = mesh_vertex(d, a, f[2]) - g[a][j];
+        }
+
+        tb->v0[a] = g[a];
+        tb->e1[a] = g[3 + a];
+        tb->e2[a] = g[6 + a];
+    }
+}
+
+// Tests ray against triangles [first, first + count) of d, a batch at
+// a time. If any of them is hit before *t, the closest one is left on
+// *hit, with its distance on *t and its barycentrics on *hu and *hv
+static inline void
+intersect_leaf(const struct ray_t *ray, const struct mesh_data_t *d, uint32_t first, uint32_t count, float *t, uint32_t *hit, float *hu, float *hv)
+{
+    float bt[TRIANGLE_BATCH], bu[TRIANGLE_BATCH], bv[TRIANGLE_BATCH];
+    float g[9][TRIANGLE_BATCH];
+    uint32_t batch = 0;
+    struct triangle_batch_t tb;
+
+    for(int a = 0; a < 3; a++)
+    {
+        tb.v0[a] = d->v0[a];
+        tb.e1[a] = d->e1[a];
+        tb.e2[a] = d->e2[a];
+    }
+
+    // Triangles are sorted like the leaves, so there's no need
+    // to go through bvh->indices
+    for(uint32_t b = first; b < first + count; b += TRIANGLE_BATCH)
+    {
+        batch = MIN(TRIANGLE_BATCH, first + count - b);
+        if(d->faces != NULL)
+        {
+            gather_triangles(d, b, batch, g, &tb);
+            intersect_triangles(ray, &tb, d->single_sided, 0, batch, bt, bu, bv);
+        }
+        else
+            intersect_triangles(ray, &tb, d->single_sided, b, batch, bt, bu, bv);
+
+        for(uint32_t j = 0; j < batch; j++)
+        {
+            if(bt[j] < *t)
+            {
+                *t = bt[j];
+                *hit = b + j;
+                *hu = bu[j];
+                *hv = bv[j];
+            }
+        }
+    }
+}
+
+// Fills info with triangle hit of mesh, which world (the ray in world
+// space) hits t away. Only the closest hit ever needs this
+static void
+mesh_hit_info(struct ray_t *world, struct mesh_t *mesh, uint32_t hit, float hu, float hv, float t, struct hit_info_t *info)
+{
+    float g[9][TRIANGLE_BATCH];
+    float (*inv)[4] = mesh->inv_transform;
+    struct mesh_data_t *d = mesh->data;
+    struct triangle_batch_t tb;
+    struct pv_t n;
+
+    info->u = 1.0f - hu - hv;
+    info->v = hu;
+    info->w = hv;
+    info->object = NULL;
+    info->param = mesh->param;
+
+    if(d->faces != NULL)
+    {
+        gather_triangles(d, hit, 1, g, &tb);
+        cross_pv(
+            &(struct pv_t){g[3][0], g[4][0], g[5][0], 0.0f},
+            &(struct pv_t){g[6][0], g[7][0], g[8][0], 0.0f}, &n
+        );
+        normalize_pv(&n, &n);
+    }
+    else
+        n = PV(d->n[0][hit], d->n[1][hit], d->n[2][hit]);
+
+    if(mesh->update == MESH_UPDATE_INSTANCE)
+    {
+        // Normals go back with the transpose of the inverse
+        info->normal.x = inv[0][0] * n.x + inv[1][0] * n.y + inv[2][0] * n.z;
+        info->normal.y = inv[0][1] * n.x + inv[1][1] * n.y + inv[2][1] * n.z;
+        info->normal.z = inv[0][2] * n.x + inv[1][2] * n.y + inv[2][2] * n.z;
+        normalize_pv(&info->normal, &info->normal);
+    }
+    else
+        info->normal = n;
+
+    ray_intersect_point(world, t, &info->hit_point);
+}
+
+// Walks the bvh of mesh looking for triangles ray hits before *t. The
+// closest one is left on *hit, with its distance on *t and barycentrics
+// on *hu and *hv. With any set it stops at the first hit it finds
+// instead, which is all shadow rays need. ray has to be in the mesh's
+// space already
+static inline void
+traverse_mesh(struct ray_t *ray, struct mesh_t *mesh, bool any, float *t, uint32_t *hit, float *hu, float *hv)
+{
+    bool wide = false;
+    struct bvh_t *bvh = &mesh->data->bvh;
+    uint32_t first = 0, count = 0;
+    struct bvh_stack_t stack;
+    struct bvh_wide_stack_t wide_stack;
+    struct bvh_node_t *leaf = NULL;
+
+    // Use the wide bvh if there is one
+    wide = bvh->wide.node_count > 0;
+    stack.sp = wide_stack.sp = 0;
+    if(wide)
+        bvh_wide_stack_init(ray, bvh, &wide_stack, *t);
+    else
+        bvh_stack_init(ray, bvh, &stack, *t);
+
+    while(true)
+    {
+        if(wide)
+        {
+            if(!bvh_wide_next_leaf(ray, &bvh->wide, &wide_stack, *t, &first, &count))
+                break;
+        }
+        else
+        {
+            if((leaf = bvh_next_leaf(ray, bvh->nodes, &stack, *t)) == NULL)
+                break;
+            first = leaf->first;
+            count = leaf->count;
+        }
+
+        intersect_leaf(ray, mesh->data, first, count, t, hit, hu, hv);
+        if(any && *hit != UINT32_MAX)
+            break;
+    }
+}
+
+// Finds the closest triangle of mesh (which is scene mesh index) ray
+// hits before *t. If there is one, *t and hit are updated with it.
+// Instances are intersected in object space, but t is the same in both
+static void
+intersect_mesh(struct ray_t *ray, struct mesh_t *mesh, uint32_t index, float *t, struct hit_t *hit)
+{
+    float hu = 0.0f, hv = 0.0f;
+    struct ray_t local;
+    uint32_t prim = UINT32_MAX;
+
+    if(mesh->update == MESH_UPDATE_INSTANCE)
+    {
+        transform_ray(ray, mesh->inv_transform, &local);
+        ray = &local;
+    }
+
+    traverse_mesh(ray, mesh, false, t, &prim, &hu, &hv);
+    if(prim != UINT32_MAX)
+        *hit = (struct hit_t){SCENE_REF_MESH | index, prim, hu, hv};
+}
+
+// Whether ray hits any triangle of mesh before t_max
+static bool
+mesh_occluded(struct ray_t *ray, struct mesh_t *mesh, float t_max)
+{
+    float hu = 0.0f, hv = 0.0f;
+    struct ray_t local;
+    uint32_t hit = UINT32_MAX;
+
+    if(mesh->update == MESH_UPDATE_INSTANCE)
+    {
+        transform_ray(ray, mesh->inv_transform, &local);
+        ray = &local;
+    }
+
+    traverse_mesh(ray, mesh, true, &t_max, &hit, &hu, &hv);
+    return hit != UINT32_MAX;
+}
+
+// Same as intersect_mesh, but for a single object (scene object index)
+static inline void
+intersect_object(struct ray_t *ray, struct gobject_t *object, uint32_t index, float *t, struct hit_t *hit)
+{
+    float ct = 0.0, u = 0.0, v = 0.0;
+
+    // Triangles can skip straight to the closest hit
+    if(object->type == GEOMETRY_TRIANGLE)
+    {
+        ct = intersect_triangle(ray, object, *t, &u, &v);
+        if(ct > 0.0)
+        {
+            *hit = (struct hit_t){SCENE_REF_OBJECT | index, 0, u, v};
+            *t = ct;
+        }
+        return;
+    }
+
+    ct = ray_intersect(ray, object, NULL);
+    if(ct > 0.0 && ct < *t)
+    {
+        *hit = (struct hit_t){SCENE_REF_OBJECT | index, 0, 0.0f, 0.0f};
+        *t = ct;
+    }
+}
+
+// How far along ray sphere i of l gets hit (INFINITY if it doesn't).
+// a is dir . dir, which is the same for every sphere. Uses the more
+// stable of the two ways to get the roots, since there's no double
+// precision in here. The SIMD versions below do the exact same math
+static inline float
+sphere_distance(const struct ray_t *ray, const struct sphere_list_t *l, uint32_t i, float a)
+{
+    float sx, sy, sz, b, c, disc, q, t0, t1, tn, tf;
+
+    sx = ray->orig.x - l->cx[i];
+    sy = ray->orig.y - l->cy[i];
+    sz = ray->orig.z - l->cz[i];
+
+    // Half of the usual b, which takes the 2s and 4s out of it
+    b = ray->dir.x * sx + ray->dir.y * sy + ray->dir.z * sz;
+    c = sx * sx + sy * sy + sz * sz - l->radius2[i];
+    disc = b * b - a * c;
+
+    // Most spheres are a miss, so this pays off one at a time
+    if(disc < 0.0f)
+        return INFINITY;
+
+    q = -(b + copysignf(sqrtf(disc), b));
+    t0 = q / a;
+    t1 = c / q;
+    tn = t0 < t1 ? t0 : t1;
+    tf = t0 < t1 ? t1 : t0;
+
+    // From inside, the hit is on the far side
+    tn = tn >= 0.0f ? tn : tf;
+    return tn > 0.0f ? tn : INFINITY;
+}
+
+// Nearest of spheres [first, first + count) of l that ray hits before
+// t_max. Returns its index (UINT32_MAX if there's none) and saves how
+// far it is on t. On a tie the lowest index wins, whatever the kernel
+static uint32_t
+nearest_sphere_scalar(const struct ray_t *ray, const struct sphere_list_t *l, uint32_t first, uint32_t count, float t_max, float *t)
+{
+    const float a = ray->dir.x * ray->dir.x + ray->dir.y * ray->dir.y + ray->dir.z * ray->dir.z;
+    uint32_t hit = UINT32_MAX;
+    float tt = 0.0f;
+
+    for(uint32_t i = first; i < first + count; i++)
+    {
+        tt = sphere_distance(ray, l, i, a);
+        if(tt < t_max)
+        {
+            t_max = tt;
+            hit = i;
+        }
+    }
+
+    *t = t_max;
+    return hit;
+}
+
+#ifdef RAYTRACER_X86_SIMD
+// 4 spheres at a time. Every lane keeps its own nearest hit (and the
+// first sphere of the group it was on), and they get compared at the
+// end. Whatever doesn't fill a group goes through sphere_distance
+static uint32_t
+nearest_sphere_sse(const struct ray_t *ray, const struct sphere_list_t *l, uint32_t first, uint32_t count, float t_max, float *t)
+{
+    const float af = ray->dir.x * ray->dir.x + ray->dir.y * ray->dir.y + ray->dir.z * ray->dir.z;
+    const __m128 ox = _mm_set1_ps(ray->orig.x), oy = _mm_set1_ps(ray->orig.y), oz = _mm_set1_ps(ray->orig.z);
+    const __m128 dx = _mm_set1_ps(ray->dir.x), dy = _mm_set1_ps(ray->dir.y), dz = _mm_set1_ps(ray->dir.z);
+    const __m128 a = _mm_set1_ps(af), zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.0f);
+    __m128 sx, sy, sz, b, c, disc, q, t0, t1, lt, tn, tf, ok, best = _mm_set1_ps(t_max);
+    __m128i group = _mm_set1_epi32(-1);
+    float bt[4];
+    int32_t bg[4];
+    uint32_t i = first, end = first + count, hit = UINT32_MAX;
+
+    for(; i + 4 <= end; i += 4)
+    {
+        sx = _mm_sub_ps(ox, _mm_loadu_ps(&l->cx[i]));
+        sy = _mm_sub_ps(oy, _mm_loadu_ps(&l->cy[i]));
+        sz = _mm_sub_ps(oz, _mm_loadu_ps(&l->cz[i]));
+
+        b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, sx), _mm_mul_ps(dy, sy)), _mm_mul_ps(dz, sz));
+        c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, sx), _mm_mul_ps(sy, sy)), _mm_mul_ps(sz, sz)), _mm_loadu_ps(&l->radius2[i]));
+        disc = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(a, c));
+
+        q = _mm_or_ps(_mm_sqrt_ps(_mm_max_ps(disc, zero)), _mm_and_ps(b, sign));
+        q = _mm_xor_ps(_mm_add_ps(b, q), sign);
+        t0 = _mm_div_ps(q, a);
+        t1 = _mm_div_ps(c, q);
+        lt = _mm_cmplt_ps(t0, t1);
+        tn = _mm_or_ps(_mm_and_ps(lt, t0), _mm_andnot_ps(lt, t1));
+        tf = _mm_or_ps(_mm_and_ps(lt, t1), _mm_andnot_ps(lt, t0));
+
+        lt = _mm_cmpge_ps(tn, zero);
+        tn = _mm_or_ps(_mm_and_ps(lt, tn), _mm_andnot_ps(lt, tf));
+        ok = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(disc, zero), _mm_cmpgt_ps(tn, zero)), _mm_cmplt_ps(tn, best));
+
+        best = _mm_or_ps(_mm_and_ps(ok, tn), _mm_andnot_ps(ok, best));
+        group = _mm_or_si128(_mm_and_si128(_mm_castps_si128(ok), _mm_set1_epi32(i)), _mm_andnot_si128(_mm_castps_si128(ok), group));
+    }
+
+    _mm_storeu_ps(bt, best);
+    _mm_storeu_si128((__m128i *)bg, group);
+    for(int j = 0; j < 4; j++)
+    {
+        if(bg[j] >= 0 && (bt[j] < t_max || (bt[j] == t_max && bg[j] + j < hit)))
+        {
+            t_max = bt[j];
+            hit = bg[j] + j;
+        }
+    }
+
+    for(; i < end; i++)
+    {
+        bt[0] = sphere_distance(ray, l, i, af);
+        if(bt[0] < t_max)
+        {
+            t_max = bt[0];
+            hit = i;
+        }
+    }
+
+    *t = t_max;
+    return hit;
+}
+
+// Same thing 8 at a time. Plain AVX has no integer ops on 8 lanes, so
+// the groups get picked with float masks of their bits. No blendv in
+// here either, gcc turns those into branches
+__attribute__((target("avx")))
+static uint32_t
+nearest_sphere_avx(const struct ray_t *ray, const struct sphere_list_t *l, uint32_t first, uint32_t count, float t_max, float *t)
+{
+    const float af = ray->dir.x * ray->dir.x + ray->dir.y * ray->dir.y + ray->dir.z * ray->dir.z;
+    const __m256 ox = _mm256_set1_ps(ray->orig.x), oy = _mm256_set1_ps(ray->orig.y), oz = _mm256_set1_ps(ray->orig.z);
+    const __m256 dx = _mm256_set1_ps(ray->dir.x), dy = _mm256_set1_ps(ray->dir.y), dz = _mm256_set1_ps(ray->dir.z);
+    const __m256 a = _mm256_set1_ps(af), zero = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.0f);
+    __m256 sx, sy, sz, b, c, disc, q, t0, t1, lt, tn, tf, ok, best = _mm256_set1_ps(t_max);
+    __m256 group = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    float bt[8];
+    int32_t bg[8];
+    uint32_t i = first, end = first + count, hit = UINT32_MAX;
+
+    for(; i + 8 <= end; i += 8)
+    {
+        sx = _mm256_sub_ps(ox, _mm256_loadu_ps(&l->cx[i]));
+        sy = _mm256_sub_ps(oy, _mm256_loadu_ps(&l->cy[i]));
+        sz = _mm256_sub_ps(oz, _mm256_loadu_ps(&l->cz[i]));
+
+        b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, sx), _mm256_mul_ps(dy, sy)), _mm256_mul_ps(dz, sz));
+        c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, sx), _mm256_mul_ps(sy, sy)), _mm256_mul_ps(sz, sz)), _mm256_loadu_ps(&l->radius2[i]));
+        disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(a, c));
+
+        q = _mm256_or_ps(_mm256_sqrt_ps(_mm256_max_ps(disc, zero)), _mm256_and_ps(b, sign));
+        q = _mm256_xor_ps(_mm256_add_ps(b, q), sign);
+        t0 = _mm256_div_ps(q, a);
+        t1 = _mm256_div_ps(c, q);
+        lt = _mm256_cmp_ps(t0, t1, _CMP_LT_OQ);
+        tn = _mm256_or_ps(_mm256_and_ps(lt, t0), _mm256_andnot_ps(lt, t1));
+        tf = _mm256_or_ps(_mm256_and_ps(lt, t1), _mm256_andnot_ps(lt, t0));
+
+        lt = _mm256_cmp_ps(tn, zero, _CMP_GE_OQ);
+        tn = _mm256_or_ps(_mm256_and_ps(lt, tn), _mm256_andnot_ps(lt, tf));
+        ok = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ), _mm256_cmp_ps(tn, zero, _CMP_GT_OQ));
+        ok = _mm256_and_ps(ok, _mm256_cmp_ps(tn, best, _CMP_LT_OQ));
+
+        best = _mm256_or_ps(_mm256_and_ps(ok, tn), _mm256_andnot_ps(ok, best));
+        group = _mm256_or_ps(_mm256_and_ps(ok, _mm256_castsi256_ps(_mm256_set1_epi32(i))), _mm256_andnot_ps(ok, group));
+    }
+
+    _mm256_storeu_ps(bt, best);
+    _mm256_storeu_ps((float *)bg, group);
+    for(int j = 0; j < 8; j++)
+    {
+        if(bg[j] >= 0 && (bt[j] < t_max || (bt[j] == t_max && bg[j] + j < hit)))
+        {
+            t_max = bt[j];
+            hit = bg[j] + j;
+        }
+    }
+
+    for(; i < end; i++)
+    {
+        bt[0] = sphere_distance(ray, l, i, af);
+        if(bt[0] < t_max)
+        {
+            t_max = bt[0];
+            hit = i;
+        }
+    }
+
+    *t = t_max;
+    return hit;
+}
+#endif
+
+// Picks the widest of the above this CPU can run
+static inline uint32_t
+nearest_sphere(const struct ray_t *ray, const struct sphere_list_t *l, uint32_t first, uint32_t count, float t_max, float *t)
+{
+#ifdef RAYTRACER_X86_SIMD
+    if(count >= 8 && __builtin_cpu_supports("avx"))
+        return nearest_sphere_avx(ray, l, first, count, t_max, t);
+    if(count >= 4)
+        return nearest_sphere_sse(ray, l, first, count, t_max, t);
+#endif
+    return nearest_sphere_scalar(ray, l, first, count, t_max, t);
+}
+
+// Planes [first, first + count) of l, all at once, the same way
+// intersect_triangles does it. Saves how far along ray each one got
+// hit on t (INFINITY if it wasn't). Anything (nearly) parallel to
+// ray misses
+static inline void
+intersect_planes(const struct ray_t *ray, const struct plane_list_t *l, uint32_t first, uint32_t count, float *t)
+{
+    const float ox = ray->orig.x, oy = ray->orig.y, oz = ray->orig.z;
+    const float dx = ray->dir.x, dy = ray->dir.y, dz = ray->dir.z;
+    float nd, tt;
+    uint32_t i = 0;
+
+    for(uint32_t j = 0; j < count; j++)
+    {
+        i = first + j;
+
+        nd = l->nx[i] * dx + l->ny[i] * dy + l->nz[i] * dz;
+        tt = ((l->px[i] - ox) * l->nx[i] + (l->py[i] - oy) * l->ny[i] + (l->pz[i] - oz) * l->nz[i]) / nd;
+        t[j] = (fabsf(nd) >= SMALL_F) & (tt > 0.0f) ? tt : INFINITY;
+    }
+}
+
+// Closest of spheres [first, first + count) of the scene that ray
+// hits before *t
+static inline void
+intersect_sphere_run(struct ray_t *ray, struct scene_t *scene, uint32_t first, uint32_t count, float *t, struct hit_t *hit)
+{
+    uint32_t i = nearest_sphere(ray, &scene->spheres, first, count, *t, t);
+
+    if(i != UINT32_MAX)
+        *hit = (struct hit_t){SCENE_REF_SPHERE | i, 0, 0.0f, 0.0f};
+}
+
+// Closest plane of the scene ray hits before *t
+static inline void
+intersect_all_planes(struct ray_t *ray, struct scene_t *scene, float *t, struct hit_t *hit)
+{
+    const struct plane_list_t *l = &scene->planes;
+    float bt[PLANE_BATCH];
+    uint32_t n = 0, closest = UINT32_MAX;
+
+    for(uint32_t b = 0; b < l->count; b += n)
+    {
+        n = MIN(PLANE_BATCH, l->count - b);
+        intersect_planes(ray, l, b, n, bt);
+        for(uint32_t j = 0; j < n; j++)
+        {
+            if(bt[j] < *t)
+            {
+                *t = bt[j];
+                closest = b + j;
+            }
+        }
+    }
+
+    if(closest != UINT32_MAX)
+        *hit = (struct hit_t){SCENE_REF_OBJECT | l->objects[closest], 0, 0.0f, 0.0f};
+}
+
+// Works out info for hit, which ray hits t away. Only the closest hit
+// of a ray ever gets here
+static void
+hit_attributes(struct ray_t *ray, struct scene_t *scene, float t, const struct hit_t *hit, struct hit_info_t *info)
+{
+    uint32_t index = hit->ref & SCENE_REF_INDEX;
+    struct gobject_t *object = NULL;
+    struct pv_t pv;
+
+    switch(hit->ref & SCENE_REF_TYPE)
+    {
+        case SCENE_REF_MESH:
+            mesh_hit_info(ray, scene->meshes[index], hit->prim, hit->u, hit->v, t, info);
+            return;
+
+        case SCENE_REF_SPHERE:
+            object = &scene->objects[scene->spheres.objects[index]];
+            ray_intersect_point(ray, t, &info->hit_point);
+            substract_pv(&info->hit_point, &object->center, &pv);
+            normalize_pv(&pv, &info->normal);
+            break;
+
+        default:
+            object = &scene->objects[index];
+            if(object->type == GEOMETRY_TRIANGLE)
+            {
+                triangle_hit_info(ray, object, t, hit->u, hit->v, info);
+                break;
+            }
+
+            // Planes and disks
+            ray_intersect_point(ray, t, &info->hit_point);
+            info->normal = object->normal;
+            break;
+    }
+
+    info->object = object;
+    info->param = object->param;
+}
+
+// How many spheres leaf starts with (build_scene_bvh puts them first),
+// and where the first of them is on scene->spheres
+static inline uint32_t
+leaf_spheres(struct scene_t *scene, struct bvh_node_t *leaf, uint32_t *first)
+{
+    const uint32_t *refs = &scene->bvh.indices[leaf->first];
+    uint32_t n = 0;
+
+    while(n < leaf->count && (refs[n] & SCENE_REF_TYPE) == SCENE_REF_SPHERE)
+        n++;
+
+    *first = refs[0] & SCENE_REF_INDEX;
+    return n;
+}
+
+// A bunch of rays that get traced together, one per lane. Lanes
+// are always used in groups of 4, so the ones past the last ray
+// have a t of -INFINITY, which makes them miss everything
+struct ray_packet_t
+{
+    int width;
+
+    float ox[RAYTRACER_MAX_PACKET_SIZE], oy[RAYTRACER_MAX_PACKET_SIZE], oz[RAYTRACER_MAX_PACKET_SIZE];
+    float dx[RAYTRACER_MAX_PACKET_SIZE], dy[RAYTRACER_MAX_PACKET_SIZE], dz[RAYTRACER_MAX_PACKET_SIZE];
+    float rx[RAYTRACER_MAX_PACKET_SIZE], ry[RAYTRACER_MAX_PACKET_SIZE], rz[RAYTRACER_MAX_PACKET_SIZE];
+
+    // Closest hit of each ray so far
+    float t[RAYTRACER_MAX_PACKET_SIZE];
+};
+
+// Nodes left to visit by a packet, along with the rays that go
+// through them and where the first of those rays gets in
+struct packet_stack_t
+{
+    struct
+    {
+        uint32_t node, mask;
+        float t_near;
+    } entries[BVH_MAX_DEPTH + 1];
+    size_t sp;
+};
+
+// Puts the rays of mask on p, along with their closest hit so far
+static void
+packet_load(struct ray_packet_t *p, const struct ray_t *rays, int width, uint32_t mask, const float *t)
+{
+    p->width = (width + 3) & ~3;
+    for(int j = 0; j < p->width; j++)
+    {
+        if(!(mask & (1u << j)))
+        {
+            p->ox[j] = p->oy[j] = p->oz[j] = 0.0f;
+            p->dx[j] = p->dy[j] = p->dz[j] = 0.0f;
+            p->rx[j] = p->ry[j] = p->rz[j] = 0.0f;
+            p->t[j] = -INFINITY;
+            continue;
+        }
+
+        p->ox[j] = rays[j].orig.x; p->oy[j] = rays[j].orig.y; p->oz[j] = rays[j].orig.z;
+        p->dx[j] = rays[j].dir.x; p->dy[j] = rays[j].dir.y; p->dz[j] = rays[j].dir.z;
+        p->rx[j] = rays[j].rcp_dir.x; p->ry[j] = rays[j].rcp_dir.y; p->rz[j] = rays[j].rcp_dir.z;
+        p->t[j] = t[j];
+    }
+}
+
+// ray_intersect_box for every ray of p at once. Returns which of the
+// rays in mask go through b before their closest hit, and saves where
+// the first of them gets in on t_near. Nodes are only skipped when
+// all of the rays miss them
+static inline uint32_t
+packet_intersect_box(const struct ray_packet_t *p, const struct aabb_t *b, uint32_t mask, float *t_near)
+{
+    float t0[RAYTRACER_MAX_PACKET_SIZE], nearest = INFINITY;
+    uint32_t hits = 0;
+    int j = 0;
+
+#ifdef RAYTRACER_X86_SIMD
+    const float *o[3] = {p->ox, p->oy, p->oz}, *r[3] = {p->rx, p->ry, p->rz};
+    __m128 n, f, tn, tf, v0, v1, oa, ra;
+
+    for(j = 0; j < p->width; j += 4)
+    {
+        v0 = _mm_setzero_ps();
+        v1 = _mm_loadu_ps(&p->t[j]);
+        for(int a = 0; a < 3; a++)
+        {
+            oa = _mm_loadu_ps(&o[a][j]);
+            ra = _mm_loadu_ps(&r[a][j]);
+            tn = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b->min[a]), oa), ra);
+            tf = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(b->max[a]), oa), ra);
+
+            // Operands go in the order that leaves NaNs (0 * inf) out
+            // of the interval, same as ray_intersect_box
+            n = _mm_min_ps(tf, tn);
+            f = _mm_max_ps(tn, tf);
+            v0 = _mm_max_ps(n, v0);
+            v1 = _mm_min_ps(f, v1);
+        }
+
+        _mm_storeu_ps(&t0[j], v0);
+        hits |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(v0, v1)) << j;
+    }
+#else
+    float t1 = 0.0f, tn = 0.0f, tf = 0.0f;
+    const float *o[3] = {p->ox, p->oy, p->oz}, *r[3] = {p->rx, p->ry, p->rz};
+
+    for(j = 0; j < p->width; j++)
+    {
+        t0[j] = 0.0f;
+        t1 = p->t[j];
+        for(int a = 0; a < 3; a++)
+        {
+            tn = (b->min[a] - o[a][j]) * r[a][j];
+            tf = (b->max[a] - o[a][j]) * r[a][j];
+            if(tn > tf)
+                SWAP(tn, tf, float);
+
+            t0[j] = tn > t0[j] ? tn : t0[j];
+            t1 = tf < t1 ? tf : t1;
+        }
+
+        if(t0[j] <= t1)
+            hits |= 1u << j;
+    }
+#endif
+
+    hits &= mask;
+    for(uint32_t m = hits; m != 0; m &= m - 1)
+    {
+        j = __builtin_ctz(m);
+        nearest = t0[j] < nearest ? t0[j] : nearest;
+    }
+
+    *t_near = nearest;
+    return hits;
+}
+
+// Whether any ray of mask still has its closest hit past t
+static inline bool
+packet_before(const struct ray_packet_t *p, uint32_t mask, float t)
+{
+    for(; mask != 0; mask &= mask - 1)
+        if(t < p->t[__builtin_ctz(mask)])
+            return true;
+
+    return false;
+}
+
+// Pushes whichever children of inner node n (on nodes) the rays of
+// mask go through, nearest last so it gets visited first
+static inline void
+packet_push_children(const struct ray_packet_t *p, const struct bvh_node_t *nodes, const struct bvh_node_t *n, uint32_t mask, struct packet_stack_t *stack)
+{
+    float t_left = 0.0f, t_right = 0.0f;
+    uint32_t left = 0, right = 0, l = n->first, r = n->first + 1;
+
+    left = packet_intersect_box(p, &nodes[l].bounds, mask, &t_left);
+    right = packet_intersect_box(p, &nodes[r].bounds, mask, &t_right);
+    if(left != 0 && right != 0 && t_left <= t_right)
+    {
+        stack->entries[stack->sp].node = r;
+        stack->entries[stack->sp].mask = right;
+        stack->entries[stack->sp++].t_near = t_right;
+        right = 0;
+    }
+    if(left != 0)
+    {
+        stack->entries[stack->sp].node = l;
+        stack->entries[stack->sp].mask = left;
+        stack->entries[stack->sp++].t_near = t_left;
+    }
+    if(right != 0)
+    {
+        stack->entries[stack->sp].node = r;
+        stack->entries[stack->sp].mask = right;
+        stack->entries[stack->sp++].t_near = t_right;
+    }
+}
+
+// intersect_leaf for every ray of mask at once. Each triangle gets
+// tested against all the rays, so the lanes share its edges
+static inline void
+packet_intersect_leaf(struct ray_packet_t *p, const struct mesh_data_t *d, uint32_t first, uint32_t count, uint32_t mask, uint32_t *hit, float *hu, float *hv)
+{
+    float g[9][TRIANGLE_BATCH];
+    float e1x, e1y, e1z, e2x, e2y, e2z, v0x, v0y, v0z;
+    const bool single_sided = d->single_sided;
+    uint32_t batch = 0, k = 0;
+    struct triangle_batch_t tb;
+#ifdef RAYTRACER_X86_SIMD
+    __m128 dx, dy, dz, px, py, pz, qx, qy, qz, sx, sy, sz, det, inv, tu, tv, tt, ok, live;
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), small = _mm_set1_ps(SMALL_F);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128i h;
+#else
+    float px, py, pz, qx, qy, qz, sx, sy, sz, det, inv, tu, tv, tt;
+    bool ok = false;
+#endif
+
+    for(int a = 0; a < 3; a++)
+    {
+        tb.v0[a] = d->v0[a];
+        tb.e1[a] = d->e1[a];
+        tb.e2[a] = d->e2[a];
+    }
+
+    for(uint32_t b = first; b < first + count; b += TRIANGLE_BATCH)
+    {
+        batch = MIN(TRIANGLE_BATCH, first + count - b);
+        if(d->faces != NULL)
+            gather_triangles(d, b, batch, g, &tb);
+
+        for(uint32_t i = 0; i < batch; i++)
+        {
+            k = d->faces != NULL ? i : b + i;
+            v0x = tb.v0[0][k]; v0y = tb.v0[1][k]; v0z = tb.v0[2][k];
+            e1x = tb.e1[0][k]; e1y = tb.e1[1][k]; e1z = tb.e1[2][k];
+            e2x = tb.e2[0][k]; e2y = tb.e2[1][k]; e2z = tb.e2[2][k];
+
+            // Same as intersect_triangles, only across rays instead
+            // of across triangles
+#ifdef RAYTRACER_X86_SIMD
+            for(int j = 0; j < p->width; j += 4)
+            {
+                if(((mask >> j) & 0xf) == 0)
+                    continue;
+
+                dx = _mm_loadu_ps(&p->dx[j]);
+                dy = _mm_loadu_ps(&p->dy[j]);
+                dz = _mm_loadu_ps(&p->dz[j]);
+                px = _mm_sub_ps(_mm_mul_ps(dy, _mm_set1_ps(e2z)), _mm_mul_ps(dz, _mm_set1_ps(e2y)));
+                py = _mm_sub_ps(_mm_mul_ps(dz, _mm_set1_ps(e2x)), _mm_mul_ps(dx, _mm_set1_ps(e2z)));
+                pz = _mm_sub_ps(_mm_mul_ps(dx, _mm_set1_ps(e2y)), _mm_mul_ps(dy, _mm_set1_ps(e2x)));
+                det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e1x), px), _mm_mul_ps(_mm_set1_ps(e1y), py)), _mm_mul_ps(_mm_set1_ps(e1z), pz));
+                inv = _mm_div_ps(one, det);
+
+                sx = _mm_sub_ps(_mm_loadu_ps(&p->ox[j]), _mm_set1_ps(v0x));
+                sy = _mm_sub_ps(_mm_loadu_ps(&p->oy[j]), _mm_set1_ps(v0y));
+                sz = _mm_sub_ps(_mm_loadu_ps(&p->oz[j]), _mm_set1_ps(v0z));
+                tu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+
+                qx = _mm_sub_ps(_mm_mul_ps(sy, _mm_set1_ps(e1z)), _mm_mul_ps(sz, _mm_set1_ps(e1y)));
+                qy = _mm_sub_ps(_mm_mul_ps(sz, _mm_set1_ps(e1x)), _mm_mul_ps(sx, _mm_set1_ps(e1z)));
+                qz = _mm_sub_ps(_mm_mul_ps(sx, _mm_set1_ps(e1y)), _mm_mul_ps(sy, _mm_set1_ps(e1x)));
+                tv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+                tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e2x), qx), _mm_mul_ps(_mm_set1_ps(e2y), qy)), _mm_mul_ps(_mm_set1_ps(e2z), qz)), inv);
+
+                live = _mm_castsi128_ps(_mm_cmpgt_epi32(
+                    _mm_and_si128(_mm_set1_epi32(mask >> j), _mm_setr_epi32(1, 2, 4, 8)), _mm_setzero_si128()
+                ));
+                ok = _mm_and_ps(live, _mm_cmpgt_ps(single_sided ? det : _mm_and_ps(det, abs_mask), small));
+                ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(tu, zero), _mm_cmpge_ps(tv, zero)));
+                ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(tu, tv), one));
+                ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpgt_ps(tt, zero), _mm_cmplt_ps(tt, _mm_loadu_ps(&p->t[j]))));
+                if(_mm_movemask_ps(ok) == 0)
+                    continue;
+
+                _mm_storeu_ps(&p->t[j], _mm_or_ps(_mm_and_ps(ok, tt), _mm_andnot_ps(ok, _mm_loadu_ps(&p->t[j]))));
+                _mm_storeu_ps(&hu[j], _mm_or_ps(_mm_and_ps(ok, tu), _mm_andnot_ps(ok, _mm_loadu_ps(&hu[j]))));
+                _mm_storeu_ps(&hv[j], _mm_or_ps(_mm_and_ps(ok, tv), _mm_andnot_ps(ok, _mm_loadu_ps(&hv[j]))));
+                h = _mm_castps_si128(ok);
+                _mm_storeu_si128((__m128i *)&hit[j], _mm_or_si128(
+                    _mm_and_si128(h, _mm_set1_epi32(b + i)),
+                    _mm_andnot_si128(h, _mm_loadu_si128((const __m128i *)&hit[j]))
+                ));
+            }
+#else
+            for(int j = 0; j < p->width; j++)
+            {
+                px = p->dy[j] * e2z - p->dz[j] * e2y;
+                py = p->dz[j] * e2x - p->dx[j] * e2z;
+                pz = p->dx[j] * e2y - p->dy[j] * e2x;
+                det = e1x * px + e1y * py + e1z * pz;
+                inv = 1.0f / det;
+
+                sx = p->ox[j] - v0x;
+                sy = p->oy[j] - v0y;
+                sz = p->oz[j] - v0z;
+                tu = (sx * px + sy * py + sz * pz) * inv;
+
+                qx = sy * e1z - sz * e1y;
+                qy = sz * e1x - sx * e1z;
+                qz = sx * e1y - sy * e1x;
+                tv = (p->dx[j] * qx + p->dy[j] * qy + p->dz[j] * qz) * inv;
+                tt = (e2x * qx + e2y * qy + e2z * qz) * inv;
+
+                ok = ((mask >> j) & 1) & ((single_sided ? det : fabsf(det)) > SMALL_F) &
+                    (tu >= 0.0f) & (tv >= 0.0f) & (tu + tv <= 1.0f) & (tt > 0.0f) & (tt < p->t[j]);
+                if(!ok)
+                    continue;
+
+                p->t[j] = tt;
+                hit[j] = b + i;
+                hu[j] = tu;
+                hv[j] = tv;
+            }
+#endif
+        }
+    }
+}
+
+// intersect_mesh for the rays of mask on p (rays has them as regular
+// rays). Each node gets tested against all of them at once, until
+// there are PACKET_MIN_RAYS or less of them left on it. Those go
+// the rest of the way on their own
+static void
+packet_intersect_mesh(struct ray_packet_t *p, struct ray_t *rays, uint32_t mask, struct mesh_t *mesh, uint32_t index, struct hit_t *hits)
+{
+    struct mesh_data_t *d = mesh->data;
+    struct bvh_node_t *nodes = d->bvh.nodes, *n = NULL, *leaf = NULL;
+    struct ray_packet_t local_packet, *lp = p;
+    struct ray_t local[RAYTRACER_MAX_PACKET_SIZE], *lr = rays;
+    struct packet_stack_t stack;
+    struct bvh_stack_t single;
+    uint32_t hit[RAYTRACER_MAX_PACKET_SIZE], m = 0;
+    float hu[RAYTRACER_MAX_PACKET_SIZE], hv[RAYTRACER_MAX_PACKET_SIZE], t_near = 0.0f;
+    int j = 0;
+
+    // Compressed meshes don't keep the binary bvh around, and
+    // a couple of rays are better off on their own anyway
+    if(d->bvh.wide.qbounds != NULL || __builtin_popcount(mask) <= PACKET_MIN_RAYS)
+    {
+        for(m = mask; m != 0; m &= m - 1)
+        {
+            j = __builtin_ctz(m);
+            intersect_mesh(&rays[j], mesh, index, &p->t[j], &hits[j]);
+        }
+        return;
+    }
+
+    if(d->bvh.node_count == 0)
+        return;
+
+    if(mesh->update == MESH_UPDATE_INSTANCE)
+    {
+        for(m = mask; m != 0; m &= m - 1)
+        {
+            j = __builtin_ctz(m);
+            transform_ray(&rays[j], mesh->inv_transform, &local[j]);
+        }
+        packet_load(&local_packet, local, p->width, mask, p->t);
+        lp = &local_packet;
+        lr = local;
+    }
+
+    for(j = 0; j < RAYTRACER_MAX_PACKET_SIZE; j++)
+        hit[j] = UINT32_MAX;
+
+    stack.sp = 0;
+    if((m = packet_intersect_box(lp, &nodes[0].bounds, mask, &t_near)) != 0)
+    {
+        stack.entries[0].node = 0;
+        stack.entries[0].mask = m;
+        stack.entries[0].t_near = t_near;
+        stack.sp = 1;
+    }
+
+    while(stack.sp > 0)
+    {
+        stack.sp--;
+        m = stack.entries[stack.sp].mask;
+        n = &nodes[stack.entries[stack.sp].node];
+        if(!packet_before(lp, m, stack.entries[stack.sp].t_near))
+            continue;
+
+        if(__builtin_popcount(m) <= PACKET_MIN_RAYS)
+        {
+            for(; m != 0; m &= m - 1)
+            {
+                j = __builtin_ctz(m);
+                single.entries[0].node = n - nodes;
+                single.entries[0].t_near = 0.0f;
+                single.sp = 1;
+                while((leaf = bvh_next_leaf(&lr[j], nodes, &single, lp->t[j])) != NULL)
+                    intersect_leaf(&lr[j], d, leaf->first, leaf->count, &lp->t[j], &hit[j], &hu[j], &hv[j]);
+            }
+            continue;
+        }
+
+        if(n->count > 0)
+            packet_intersect_leaf(lp, d, n->first, n->count, m, hit, hu, hv);
+        else
+            packet_push_children(lp, nodes, n, m, &stack);
+    }
+
+    for(m = mask; m != 0; m &= m - 1)
+    {
+        j = __builtin_ctz(m);
+        if(hit[j] == UINT32_MAX)
+            continue;
+
+        p->t[j] = lp->t[j];
+        hits[j] = (struct hit_t){SCENE_REF_MESH | index, hit[j], hu[j], hv[j]};
+    }
+}
+
+// closest_hit for count rays at once, which should be going
+// more or less the same way. Their hits end up on p->t and infos
+static void
+packet_closest_hit(struct ray_packet_t *p, struct ray_t *rays, int count, struct scene_t *scene, struct hit_info_t *infos)
+{
+    const float no_hit[RAYTRACER_MAX_PACKET_SIZE] = {
+        INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY,
+        INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY, INFINITY
+    };
+    uint32_t all = (1u << count) - 1, m = 0;
+    struct hit_t hits[RAYTRACER_MAX_PACKET_SIZE];
+    struct bvh_node_t *nodes = scene->bvh.nodes, *n = NULL;
+    struct packet_stack_t stack;
+    float t_near = 0.0f;
+    size_t ref = 0;
+    uint32_t spheres = 0, first = 0;
+    int j = 0;
+
+    rays_traced += count;
+    packet_load(p, rays, count, all, no_hit);
+
+    if(scene->planes.count > 0)
+        for(j = 0; j < count; j++)
+            intersect_all_planes(&rays[j], scene, &p->t[j], &hits[j]);
+
+    stack.sp = 0;
+    if(scene->bvh.node_count > 0 && (m = packet_intersect_box(p, &nodes[0].bounds, all, &t_near)) != 0)
+    {
+        stack.entries[0].node = 0;
+        stack.entries[0].mask = m;
+        stack.entries[0].t_near = t_near;
+        stack.sp = 1;
+    }
+
+    while(stack.sp > 0)
+    {
+        stack.sp--;
+        m = stack.entries[stack.sp].mask;
+        n = &nodes[stack.entries[stack.sp].node];
+        if(!packet_before(p, m, stack.entries[stack.sp].t_near))
+            continue;
+
+        if(n->count == 0)
+        {
+            packet_push_children(p, nodes, n, m, &stack);
+            continue;
+        }
 
-            // Only go further if the object is a disk
-            if(object->type == GEOMETRY_PLANE)
-                break;
+        spheres = leaf_spheres(scene, n, &first);
+        if(spheres > 0)
+        {
+            for(uint32_t r = m; r != 0; r &= r - 1)
+            {
+                j = __builtin_ctz(r);
+                intersect_sphere_run(&rays[j], scene, first, spheres, &p->t[j], &hits[j]);
+            }
+        }
 
-            // Get the radious of the intersct point
-            if(magnitude_pv(&pv) > object->radius)
-                return -1.0;
-            return t0;
-            break;
-        case GEOMETRY_TRIANGLE:
+        for(size_t i = n->first + spheres; i < n->first + n->count; i++)
+        {
+            ref = scene->bvh.indices[i];
+            if((ref & SCENE_REF_TYPE) == SCENE_REF_MESH)
             {
-                struct pv_t p, c;
-                normal_dot_dir = dot_product(&object->normal, dir);
+                packet_intersect_mesh(p, rays, m, scene->meshes[ref & SCENE_REF_INDEX], ref & SCENE_REF_INDEX, hits);
+                continue;
+            }
 
-                // Check if dir and normal are orthogonal
-                if(fabs(normal_dot_dir) < SMALL_F)
-                    return -1.0;
+            for(uint32_t r = m; r != 0; r &= r - 1)
+            {
+                j = __builtin_ctz(r);
+                intersect_object(&rays[j], &scene->objects[ref & SCENE_REF_INDEX], ref & SCENE_REF_INDEX, &p->t[j], &hits[j]);
+            }
+        }
+    }
 
-                // Check for single-sided triangle.
-                if(normal_dot_dir > 0.0 && object->single_sided)
-                    return -1.0;
+    for(j = 0; j < count; j++)
+    {
+        if(p->t[j] < INFINITY)
+            hit_attributes(&rays[j], scene, p->t[j], &hits[j], &infos[j]);
+        rays[j].object = infos[j].object;
+    }
+}
 
-                // Find t
-                t0 = (
-                    (-dot_product(&object->normal, orig) + dot_product(&object->normal, &object->edges[0])) /
-                    normal_dot_dir
-                );
-                if(t0 < 0.0)
-                    return t0;
+static inline bool
+emitter(void *param)
+{
+    return param != NULL && ((struct gparams_t *)param)->emits;
+}
+
+// Whether ray hits anything before t_max. Unlike closest_hit, this is
+// done as soon as it finds something, and never works out where or
+// what it hit. Used for shadow rays, where area lights also need their
+// own (emitting) geometry not to get in the way, hence skip_emitters
+static bool
+occluded(struct ray_t *ray, struct scene_t *scene, float t_max, bool skip_emitters)
+{
+    const struct sphere_list_t *spheres = &scene->spheres;
+    float bt[PLANE_BATCH], t = 0.0f, u = 0.0f, v = 0.0f;
+    uint32_t n = 0, first = 0, ref = 0, index = 0;
+    struct bvh_stack_t stack;
+    struct bvh_node_t *leaf = NULL;
+    struct gobject_t *object = NULL;
 
-                // Inside out test
-                // (Note: ac, cb and ba were precalculated on form_triangle)
-                ray_intersect_point(ray, t0, &pv);
+    rays_traced++;
 
-                // p = (Q-A)
-                substract_pv(&pv, &object->edges[0], &p);
-                cross_pv(&object->ba, &p, &c);
-                if(dot_product(&c, &object->normal) < 0)
-                    return -1.0;
+    for(uint32_t b = 0; b < scene->planes.count; b += n)
+    {
+        n = MIN(PLANE_BATCH, scene->planes.count - b);
+        intersect_planes(ray, &scene->planes, b, n, bt);
+        for(uint32_t j = 0; j < n; j++)
+            if(bt[j] < t_max && !(skip_emitters && emitter(scene->objects[scene->planes.objects[b + j]].param)))
+                return true;
+    }
 
-                // p = (Q-B)
-                substract_pv(&pv, &object->edges[1], &p);
-                cross_pv(&object->cb, &p, &c);
-                if((info->u = dot_product(&c, &object->normal)) < 0)
-                    return -1.0;
+    bvh_stack_init(ray, &scene->bvh, &stack, t_max);
+    while((leaf = bvh_next_leaf(ray, scene->bvh.nodes, &stack, t_max)) != NULL)
+    {
+        n = leaf_spheres(scene, leaf, &first);
+        if(n > 0 && !skip_emitters && nearest_sphere(ray, spheres, first, n, t_max, &t) != UINT32_MAX)
+            return true;
 
-                // p = (Q-C)
-                substract_pv(&pv, &object->edges[2], &p);
-                cross_pv(&object->ac, &p, &c);
-                if((info->v = dot_product(&c, &object->normal)) < 0)
-                    return -1.0;
+        // Emitters have to be skipped one by one
+        for(uint32_t i = first; n > 0 && skip_emitters && i < first + n; i++)
+        {
+            if(!emitter(scene->objects[spheres->objects[i]].param) && nearest_sphere_scalar(ray, spheres, i, 1, t_max, &t) != UINT32_MAX)
+                return true;
+        }
 
-                info->u /= object->area;
-                info->v /= object->area;
-                info->w = 1 - info->u - info->v;
-                info->normal = object->normal;
-                info->object = object;
-                ray_intersect_point(ray, t0, &info->hit_point);
+        for(uint32_t i = leaf->first + n; i < leaf->first + leaf->count; i++)
+        {
+            ref = scene->bvh.indices[i];
+            index = ref & SCENE_REF_INDEX;
+            if((ref & SCENE_REF_TYPE) == SCENE_REF_MESH)
+            {
+                if(!(skip_emitters && emitter(scene->meshes[index]->param)) && mesh_occluded(ray, scene->meshes[index], t_max))
+                    return true;
+                continue;
             }
-            break;
-        default:
-            break;
+
+            object = &scene->objects[index];
+            if(skip_emitters && emitter(object->param))
+                continue;
+
+            if(object->type == GEOMETRY_TRIANGLE)
+                t = intersect_triangle(ray, object, t_max, &u, &v);
+            else
+                t = ray_intersect(ray, object, NULL);
+            if(t > 0.0f && t < t_max)
+                return true;
+        }
     }
-    
-    return t0;
+
+    return false;
 }
 
 static float
@@ -201,29 +1605,40 @@ struct lights_t
     struct color_t diffuse_light, specular_light, ambient_light;
 };
 
+// Picks a direction on the hemisphere around normal, all of them
+// being just as likely, for the global illumination ray of bounce
+// depth. Takes exactly 2 numbers of the sampler, which is what
+// lets it keep them spread out
 static void
-generate_random_direction(struct pv_t *normal, struct pv_t *r)
+generate_random_direction(struct pv_t *normal, int depth, struct pv_t *r)
 {
-    float m2 = 0.0;
-
-    while (true) {
-        *r = PV(rrandf(-1.0f,1.0f), rrandf(-1.0f,1.0f), rrandf(-1.0f,1.0f));
-        m2 = magnitude_pv(r);
-        if (m2 > 1) continue;
-
-        normalize_pv(r,r);
-        if(dot_product(r, normal) <= 0.0)
-            scale_pv(r, -1.0, r);
-
-        return;
-    }
+    float u[2], z = 0.0, rxy = 0.0, phi = 0.0, sign = 0.0, a = 0.0, b = 0.0;
+    struct pv_t t, bt;
+
+    sampler_get(&sampler, SAMPLER_DIM_GI(depth), sampler.index, sampler.count, 2, u);
+    z = u[0];
+    rxy = sqrtf(MAX(0.0f, 1.0f - z * z));
+    phi = 2.0f * (float)M_PI * u[1];
+
+    // Any two vectors that make a basis with normal will do.
+    // Duff et al's way of getting those doesn't branch
+    sign = copysignf(1.0f, normal->z);
+    a = -1.0f/(sign + normal->z);
+    b = normal->x * normal->y * a;
+    t = (struct pv_t){1.0f + sign * normal->x * normal->x * a, sign * b, -sign * normal->x, 0.0f};
+    bt = (struct pv_t){b, sign + normal->y * normal->y * a, -normal->y, 0.0f};
+
+    r->x = (t.x * cosf(phi) + bt.x * sinf(phi)) * rxy + normal->x * z;
+    r->y = (t.y * cosf(phi) + bt.y * sinf(phi)) * rxy + normal->y * z;
+    r->z = (t.z * cosf(phi) + bt.z * sinf(phi)) * rxy + normal->z * z;
+    r->w = 0.0f;
 }
 
 static struct lights_t
 compute_lights(struct ray_t *ray, float t, struct scene_t *scene, struct gobject_t *object, struct camera_t *camera, struct hit_info_t *info, struct gparams_t *gparams)
 {
     size_t i = 0, s = 0;
-    float shadow_rt = 0.0, diffuse_intensity = 0.0, specular_intensity = 0.0;
+    float light_distance = 0.0, diffuse_intensity = 0.0, specular_intensity = 0.0;
     struct ray_t shadow_ray = {{0.0}};
     struct light_t *light = NULL;
     struct light_params_t params = {0};
@@ -246,16 +1661,15 @@ compute_lights(struct ray_t *ray, float t, struct scene_t *scene, struct gobject
         // Figure out if hitpoint is on the shadows
         shadow_orig = hit_point;
         substract_pv(&light->orig, &shadow_orig, &shadow_ray.dir);
+        light_distance = magnitude_pv(&shadow_ray.dir);
         normalize_pv(&shadow_ray.dir, &shadow_ray.dir);
         scale_pv(&shadow_ray.dir, scene->shadow_bias, &shadow_orig);
         add_pv(&shadow_orig, &hit_point, &shadow_orig);
         make_ray(&shadow_orig, &shadow_ray.dir, &shadow_ray);
 
-        shadow_rt = raytrace(&shadow_ray, scene, camera, NULL, NULL);
-
-        // If the object the shadow ray touched is not from light,
-        // The this is a shadow
-        if(shadow_rt > 0.0 && shadow_rt < INFINITY)
+        // Anything between here and the light means this is a shadow.
+        // Whatever is past the light doesn't count
+        if(occluded(&shadow_ray, scene, light_distance - scene->shadow_bias, false))
             continue;
 
         // If global illumination hasn't been specified, use
@@ -292,36 +1706,44 @@ compute_lights(struct ray_t *ray, float t, struct scene_t *scene, struct gobject
             if(light->type != AREA_LIGHT)
                 continue;
 
-            float t = 0.0, intensity = 0.0;
+            float distance = 0.0, intensity = 0.0, u[3];
             struct pv_t rand_buffer, ps;
-            struct gparams_t *params;
-            struct hit_info_t info;
+            struct hit_info_t light_info = {0};
+            struct gparams_t *light_params = NULL;
 
             struct color_t diffuse_temp = {0.0}, specular_temp = {0.0}, ambient_temp = {0.0};
 
+            // Each sample of the pixel takes area_light_n points
+            // of the light, and all of them get spread out together
+            sampler_get(&sampler, SAMPLER_DIM_LIGHT(ray->depth, s),
+                sampler.index * scene->area_light_n + i, sampler.count * scene->area_light_n, 3, u);
             rand_buffer = PV(
-                rrandf(light->xlimits[0], light->xlimits[1]), 
-                rrandf(light->ylimits[0], light->ylimits[1]), 
-                rrandf(light->zlimits[0], light->zlimits[1])
+                light->xlimits[0] + (light->xlimits[1] - light->xlimits[0]) * u[0],
+                light->ylimits[0] + (light->ylimits[1] - light->ylimits[0]) * u[1],
+                light->zlimits[0] + (light->zlimits[1] - light->zlimits[0]) * u[2]
             );
 
             substract_pv(&rand_buffer, &light_ray.orig, &light_ray.dir);
+            distance = magnitude_pv(&light_ray.dir);
             normalize_pv(&light_ray.dir, &light_ray.dir);
             
             make_ray(&light_ray.orig, &light_ray.dir, &light_ray);
             light_ray.indirect = true;
 
-            light_ray.object = NULL;
-            t = raytrace(&light_ray, scene, camera, NULL, &info);
-            if(light_ray.object != NULL)
-                params = (struct gparams_t *)light_ray.object->param;
+            // Anything that doesn't emit on the way to the sampled spot
+            // shadows it, which is what the any-hit query is for. The
+            // light is then whatever emitting geometry the ray gets to
+            // first, and its colors are the ones that geometry emits
+            if(occluded(&light_ray, scene, distance, true))
+                continue;
 
-            if(t < 0.0 || t == INFINITY || !params->emits)
+            if(raytrace(&light_ray, scene, camera, NULL, &light_info) == INFINITY || !emitter(light_info.param))
                 continue;
+            light_params = (struct gparams_t *)light_info.param;
             
             // Calculate diffuse light
             intensity = MAX(0.0, dot_product(normal, &light_ray.dir)) * M_PI;
-            diffuse_temp = scale_color(params->id, intensity);
+            diffuse_temp = scale_color(light_params->id, intensity);
 
             add_pv(&light_ray.dir, &ray->inv_dir, &ps);
             normalize_pv(&ps, &ps);
@@ -331,7 +1753,7 @@ compute_lights(struct ray_t *ray, float t, struct scene_t *scene, struct gobject
             intensity = pow(intensity, gparams->pc);
 
             // Calculate specular light
-            specular_temp = scale_color(params->is, intensity);
+            specular_temp = scale_color(light_params->is, intensity);
 
             indirect_diffuse = add_color(indirect_diffuse, diffuse_temp);
             indirect_specular = add_color(indirect_specular, specular_temp);
@@ -383,101 +1805,112 @@ shade(struct ray_t *ray, float t, struct scene_t *scene, struct gobject_t *objec
     return color;
 }
 
+// Finds the closest thing ray hits. Returns how far away it is
+// (INFINITY if there's nothing), and saves the rest on info
 static float
-raytrace(struct ray_t *ray, struct scene_t *scene, struct camera_t *camera, struct color_t *color, struct hit_info_t *ext_info)
+closest_hit(struct ray_t *ray, struct scene_t *scene, struct hit_info_t *info)
 {
-    float t = 0.0, ct = 0.0;
-    size_t i = 0, s = 0;
-    struct hit_info_t info = {0}, b_info = {0};
-    struct gobject_t *intersecting = NULL;
-    struct gparams_t *param;
-
-    t = INFINITY;
-
-    // Do all the primitives 
-    // inf("objects seen: %ld", scene->objects_count);
-    for(i = 0; i < scene->objects_count; i++)
+    float t = INFINITY;
+    size_t i = 0, ref = 0;
+    uint32_t spheres = 0, first = 0;
+    struct bvh_stack_t stack;
+    struct bvh_node_t *leaf = NULL;
+    struct hit_t hit;
+
+    rays_traced++;
+
+    // Planes go on forever, so there's no skipping them
+    intersect_all_planes(ray, scene, &t, &hit);
+
+    // Everything else is on the scene's bvh, with each mesh
+    // having its own bvh under that. Spheres come first on
+    // each leaf, and all go in one go
+    bvh_stack_init(ray, &scene->bvh, &stack, t);
+    while((leaf = bvh_next_leaf(ray, scene->bvh.nodes, &stack, t)) != NULL)
     {
-        ct = ray_intersect(ray, &scene->objects[i], &b_info);
-        /* inf("[%ld] t = %f, ct = %f", i, t, ct); */
-        if(ct > 0.0 && ct < t)
+        spheres = leaf_spheres(scene, leaf, &first);
+        if(spheres > 0)
+            intersect_sphere_run(ray, scene, first, spheres, &t, &hit);
+
+        for(i = leaf->first + spheres; i < leaf->first + leaf->count; i++)
         {
-            info = b_info;
-            t = ct;
-            intersecting = &scene->objects[i];
+            ref = scene->bvh.indices[i];
+            if((ref & SCENE_REF_TYPE) == SCENE_REF_MESH)
+                intersect_mesh(ray, scene->meshes[ref & SCENE_REF_INDEX], ref & SCENE_REF_INDEX, &t, &hit);
+            else
+                intersect_object(ray, &scene->objects[ref & SCENE_REF_INDEX], ref & SCENE_REF_INDEX, &t, &hit);
         }
     }
 
-    // Now do all the meshes
-    for(i = 0; i < scene->mesh_count; i++)
-    {
-        // if(scene->meshes[i]->has_bounding_sphere)
-        // {
-        //     ct = ray_intersect(ray, &scene->meshes[i]->bounding_sphere, &b_info);
-        //     if(ct < 0.0 || ct >= t)
-        //         continue;
-        // }
+    // Only now that it's known which one is closest
+    if(t < INFINITY)
+        hit_attributes(ray, scene, t, &hit, info);
 
-        for(s = 0; s < scene->meshes[i]->triangle_count; s++)
-        {
-            ct = ray_intersect(ray, &scene->meshes[i]->triangles[s], &b_info);
+    return t;
+}
 
-            if(ct > 0.0 && ct < t)
-            {
-                info = b_info;
-                t = ct;
-                intersecting = &scene->meshes[i]->triangles[s];
-            }
-        }
-    }
+// Works out the color of whatever ray hit t away (see closest_hit)
+static void
+shade_hit(struct ray_t *ray, float t, struct hit_info_t *info, struct scene_t *scene, struct camera_t *camera, struct color_t *color)
+{
+    struct gparams_t *param;
 
-    ray->object = intersecting;
-    // If color = NULL, just return the distnace
-    if(color != NULL)
+    // If you hit anything...
+    if(t < INFINITY)
     {
-        // If you hit anything...
-        if(intersecting != NULL)
+        // Check to see if that color has an object
+        if(info->param == NULL)
         {
-            // Check to see if that color has an object
-            if(intersecting->param == NULL)
-            {
-                param = &DEFAULT_OBJECT_PARAMS;
-            }
-            else
-                param = (struct gparams_t *)intersecting->param;
+            param = &DEFAULT_OBJECT_PARAMS;
+        }
+        else
+            param = (struct gparams_t *)info->param;
 
-            // Apply light to color
+        // Apply light to color
+        
+        if(scene->global_illumination && ray->primary_ray && ray->depth < scene->max_depth)
+        {
+            struct ray_t child_ray;
+            struct pv_t direction;
+            float n_dor_dir = 0.0;
+            struct color_t child_lights = {0.0};
+            struct hit_info_t child_info = {0};
             
-            if(scene->global_illumination && ray->primary_ray && ray->depth < scene->max_depth)
-            {
-                struct ray_t child_ray;
-                struct pv_t direction;
-                float n_dor_dir = 0.0;
-                struct color_t child_lights = {0.0};
-                struct hit_info_t child_info = {0};
-                
-                generate_random_direction(&info.normal, &direction);
-                make_ray(&info.hit_point, &direction, &child_ray);
-                child_ray.depth = ray->depth + 1;
-                child_ray.primary_ray = true;
-                n_dor_dir = dot_product(&info.normal, &direction);
-
-                raytrace(&child_ray, scene, camera, &child_lights, &child_info);
-                child_lights = scale_color(child_lights, n_dor_dir);
-
-                *color = shade(ray, t, scene, intersecting, camera, &info, param);
-                // child_lights = scale_color(child_lights, 1.0f / (2.0f * (float)M_PI));
-                *color = add_color(*color, child_lights);
-            }
-            else
-            {
-                *color = shade(ray, t, scene, intersecting, camera, &info, param);
-                *color = clamp_color(*color);
-            }
+            generate_random_direction(&info->normal, ray->depth, &direction);
+            make_ray(&info->hit_point, &direction, &child_ray);
+            child_ray.depth = ray->depth + 1;
+            child_ray.primary_ray = true;
+            n_dor_dir = dot_product(&info->normal, &direction);
+
+            raytrace(&child_ray, scene, camera, &child_lights, &child_info);
+            child_lights = scale_color(child_lights, n_dor_dir);
+
+            *color = shade(ray, t, scene, info->object, camera, info, param);
+            // child_lights = scale_color(child_lights, 1.0f / (2.0f * (float)M_PI));
+            *color = add_color(*color, child_lights);
+        }
+        else
+        {
+            *color = shade(ray, t, scene, info->object, camera, info, param);
+            *color = clamp_color(*color);
         }
-        else 
-            *color = camera->background_color;
     }
+    else 
+        *color = camera->background_color;
+}
+
+static float
+raytrace(struct ray_t *ray, struct scene_t *scene, struct camera_t *camera, struct color_t *color, struct hit_info_t *ext_info)
+{
+    float t = 0.0;
+    struct hit_info_t info = {0};
+
+    t = closest_hit(ray, scene, &info);
+
+    ray->object = info.object;
+    // If color = NULL, just return the distnace
+    if(color != NULL)
+        shade_hit(ray, t, &info, scene, camera, color);
 
     if(ext_info != NULL)
         *ext_info = info;
@@ -485,129 +1918,436 @@ raytrace(struct ray_t *ray, struct scene_t *scene, struct camera_t *camera, stru
     return t;
 }
 
-void
-raytracer_render(struct scene_t *scene, struct camera_t *camera,  struct framebuffer_t *fb)
+struct render_job_t
 {
-    size_t aa = 0;
-    struct ray_t ray;
-    struct color_t color_buffer;
-    struct pv_t orig = {0.0}, dir = {0.0};
-    float ratio = 0.0, scale = 0.0, aa_scale = 0.0;
-    struct raytracer_opts_t *opts = NULL;
-    
-    ratio =1.0/( (float)fb->width/(float)fb->width);
+    struct scene_t *scene;
+    struct camera_t *camera;
+    struct framebuffer_t *fb;
+    struct raytracer_opts_t *opts;
 
-    // Get parameters from camera
-    if(camera->opts == NULL)
-        opts = &DEFAULT_OPTS;
-    else
-        opts = (struct raytracer_opts_t *)camera->opts;
+    float ratio, scale;
 
-    scale = tan(deg2rad(opts->fov/2.0));
-    transform_pv(camera->inv_transform, &orig, &orig);
+    // Where camera rays start, and where the one of pixel (x, y)
+    // goes: dir + x * dx + y * dy (see camera_rays_init)
+    struct pv_t orig, dir, dx, dy;
 
-    if(scene->samples < 1)
-        scene->samples = 1;
+    // Seed of this frame's random numbers, and how many samples
+    // each pixel takes (see seed_sample)
+    uint32_t seed, samples;
 
-    // This macro will create a ray object with an origin at (0,0)
-    // and a direction pointing to the pixel on screen specified by
-    // xc and yc. The end result will be saved on 'ray'
-#define FORM_RAY(xc, yc)                                                        \
-    orig = PV(0.0, 0.0, 0.0);                                                   \
-    dir.x = ((2.0 * ((xc) +0.5)/(float)fb->width) - 1.0)*scale;                 \
-    dir.y = (1.0 - 2.0 * ((float)(yc) + 0.5)/(float)fb->height)*scale*ratio;    \
-    dir.z = 1.0;                                                                \
-    dir.w = 0.0;                                                                \
-    transform_pv(camera->transform, &dir, &dir);                                \
-    transform_pv(camera->transform, &orig, &orig);                              \
-    normalize_pv(&dir, &dir);                                                   \
-                                                                                \
-    make_ray(&orig, &dir, &ray);                                                \
-    ray.primary_ray = true;                                                     \
-    ray.depth = opts->depth;
-
-#define LOG_RAYS_PRINT()                                                        \
-    rc++;                                                                       \
-    printf("\r[%lu out of %lu] (%f%%)", rc, max_rc,                             \
-            ((float)rc/(float)max_rc)*100.0);
+    struct render_context_t *ctx;
+    atomic_size_t rays;
 
 #ifdef LOG_RAYS
-    size_t rc = 0;
-    const size_t max_rc = fb->height * fb->width;
-    inf("Rays shot: ");
+    atomic_size_t rc;
+    size_t max_rc;
 #endif
+};
 
-    aa = opts->aa;
-    
-    if(aa > 0)
+// The direction to a pixel on screen is the same linear function of
+// its coordinates for the whole frame, so the camera's transform only
+// has to be applied once, to the direction of the first pixel and to
+// how that changes from one pixel (or row) to the next
+static void
+camera_rays_init(struct render_job_t *job)
+{
+    struct framebuffer_t *fb = job->fb;
+    struct camera_t *camera = job->camera;
+    struct pv_t orig = PV(0.0, 0.0, 0.0), dir = {0.0}, dx = {0.0}, dy = {0.0};
+
+    dir.x = (1.0/(float)fb->width - 1.0)*job->scale;
+    dir.y = (1.0 - 1.0/(float)fb->height)*job->scale*job->ratio;
+    dir.z = 1.0;
+    dx.x = 2.0/(float)fb->width*job->scale;
+    dy.y = -2.0/(float)fb->height*job->scale*job->ratio;
+
+    transform_pv(camera->transform, &orig, &job->orig);
+    transform_pv(camera->transform, &dir, &job->dir);
+    transform_pv(camera->transform, &dx, &job->dx);
+    transform_pv(camera->transform, &dy, &job->dy);
+}
+
+// Creates a ray with an origin at the camera and a direction
+// pointing to the pixel on screen specified by xc and yc. Same
+// as make_ray, but the direction only gets normalized once
+static inline void
+camera_ray(struct render_job_t *job, float xc, float yc, struct ray_t *ray)
+{
+    struct pv_t dir;
+
+    dir.x = job->dir.x + xc * job->dx.x + yc * job->dy.x;
+    dir.y = job->dir.y + xc * job->dx.y + yc * job->dy.y;
+    dir.z = job->dir.z + xc * job->dx.z + yc * job->dy.z;
+    dir.w = 0.0;
+    normalize_pv(&dir, &ray->dir);
+
+    ray->orig = job->orig;
+    ray->orig.w = 1.0;
+    scale_pv(&ray->dir, -1.0, &ray->inv_dir);
+    inverse_pv(&ray->dir, &ray->rcp_dir);
+    ray->dir_sign[0] = (ray->rcp_dir.x < 0);
+    ray->dir_sign[1] = (ray->rcp_dir.y < 0);
+    ray->dir_sign[2] = (ray->rcp_dir.z < 0);
+    ray->indirect = false;
+    ray->primary_ray = true;
+    ray->depth = job->opts->depth;
+}
+
+// Camera rays for count pixels of row y, starting at x0. On x86 they
+// get their directions worked out 4 at a time, the rest is the same
+// as camera_ray
+static void
+camera_rays(struct render_job_t *job, size_t y, size_t x0, size_t count, struct ray_t *rays)
+{
+    size_t j = 0;
+#ifdef RAYTRACER_X86_SIMD
+    const float yc = y;
+    const __m128 one = _mm_set1_ps(1.0f), step = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    const __m128 bx = _mm_set1_ps(job->dir.x + yc * job->dy.x);
+    const __m128 by = _mm_set1_ps(job->dir.y + yc * job->dy.y);
+    const __m128 bz = _mm_set1_ps(job->dir.z + yc * job->dy.z);
+    __m128 xc, dx, dy, dz, len;
+    float d[3][4], r[3][4];
+    struct ray_t *ray = NULL;
+
+    for(; j + 4 <= count; j += 4)
     {
-#ifdef LOG_RAYS
-    const size_t max_rc = fb->height * fb->width * opts->aa;
+        xc = _mm_add_ps(_mm_set1_ps((float)(x0 + j)), step);
+        dx = _mm_add_ps(bx, _mm_mul_ps(xc, _mm_set1_ps(job->dx.x)));
+        dy = _mm_add_ps(by, _mm_mul_ps(xc, _mm_set1_ps(job->dx.y)));
+        dz = _mm_add_ps(bz, _mm_mul_ps(xc, _mm_set1_ps(job->dx.z)));
+
+        len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        dx = _mm_div_ps(dx, len);
+        dy = _mm_div_ps(dy, len);
+        dz = _mm_div_ps(dz, len);
+        _mm_storeu_ps(d[0], dx);
+        _mm_storeu_ps(d[1], dy);
+        _mm_storeu_ps(d[2], dz);
+
+        // Dividing by a zero already gives the infinity inverse_pv would
+        _mm_storeu_ps(r[0], _mm_div_ps(one, dx));
+        _mm_storeu_ps(r[1], _mm_div_ps(one, dy));
+        _mm_storeu_ps(r[2], _mm_div_ps(one, dz));
+
+        for(int k = 0; k < 4; k++)
+        {
+            ray = &rays[j + k];
+            ray->orig = job->orig;
+            ray->orig.w = 1.0;
+            ray->dir = (struct pv_t){d[0][k], d[1][k], d[2][k], 0.0f};
+            ray->inv_dir = (struct pv_t){-d[0][k], -d[1][k], -d[2][k], 0.0f};
+            ray->rcp_dir = (struct pv_t){r[0][k], r[1][k], r[2][k], 0.0f};
+            ray->dir_sign[0] = (r[0][k] < 0);
+            ray->dir_sign[1] = (r[1][k] < 0);
+            ray->dir_sign[2] = (r[2][k] < 0);
+            ray->indirect = false;
+            ray->primary_ray = true;
+            ray->depth = job->opts->depth;
+        }
+    }
 #endif
 
+    for(; j < count; j++)
+        camera_ray(job, x0 + j, y, &rays[j]);
+}
+
+// Every pixel gets its own sequence, keyed by the frame and the pixel,
+// and this points the sampler at the given sample of it. That way the
+// image doesn't depend on how the tiles were split between threads,
+// and each frame of an animation still gets its own noise
+static inline void
+seed_sample(struct render_job_t *job, size_t pixel, size_t sample)
+{
+    sampler_init(&sampler, job->opts->sampler, rng_hash(job->seed, pixel), sample, job->samples);
+}
+
+// Traces ray, which is for pixel, scene->samples times. Those are
+// samples first and up, and the stream of the first one has to be
+// seeded already, since anti-aliasing takes its jitter from it
+static struct color_t
+render_sample(struct render_job_t *job, struct ray_t *ray, size_t pixel, size_t first)
+{
+    struct scene_t *scene = job->scene;
+    struct color_t global_ilumn_buffer = {0.0};
+
+    for(size_t s = 0; s < scene->samples; s++)
+    {
+        struct color_t c;
+        if(s > 0)
+            seed_sample(job, pixel, first + s);
+        raytrace(ray, scene, job->camera, &c, NULL);
+        global_ilumn_buffer = add_color(global_ilumn_buffer, c);
+    }
+
+    return scale_color(global_ilumn_buffer, 1.0f/scene->samples);
+}
+
+// Same as render_sample for the count pixels of row y that start at x0
+// and have their camera rays on rays, but tracing those as a packet.
+// Their hits get shaded once per sample, so those only cost the
+// secondary rays. infos has room for count hits
+static void
+render_packet(struct render_job_t *job, size_t y, size_t x0, int count, struct ray_t *rays, struct hit_info_t *infos)
+{
+    struct hit_info_t info;
+    struct ray_packet_t packet;
+    struct scene_t *scene = job->scene;
+    struct framebuffer_t *fb = job->fb;
+    struct color_t color, c;
+
+    memset(infos, 0, count * sizeof(struct hit_info_t));
+    packet_closest_hit(&packet, rays, count, scene, infos);
+
+    for(int j = 0; j < count; j++)
+    {
+        color = (struct color_t){0.0};
+        for(int s = 0; s < scene->samples; s++)
+        {
+            seed_sample(job, y * fb->width + x0 + j, s);
+            info = infos[j];
+            shade_hit(&rays[j], packet.t[j], &info, scene, job->camera, &c);
+            color = add_color(color, c);
+        }
+
+        color = scale_color(color, 1.0f/scene->samples);
+        fb->pixels[y * fb->width + x0 + j] = color_to_pixel(color);
+    }
+}
+
+// Renders pixels [x0, x1) of row y. rays has room for a camera ray per
+// pixel, and infos for the hits of a packet
+static void
+render_row(struct render_job_t *job, size_t y, size_t x0, size_t x1, struct ray_t *rays, struct hit_info_t *infos)
+{
+    size_t aa = 0;
+    int packet = 0;
+    float aa_scale = 0.0;
+    struct color_t color_buffer;
+    struct framebuffer_t *fb = job->fb;
+    struct ray_t ray;
+    float jitter[2];
+
+    aa = job->opts->aa;
+    if(aa > 0)
         aa_scale = 1.0/aa;
-        for(size_t y = 0; y < fb->height; y++)
+    else
+        camera_rays(job, y, x0, x1 - x0, rays);
+
+    // Anti-aliased rays are jittered, so they don't go in packets
+    packet = MIN(job->opts->packet_size, RAYTRACER_MAX_PACKET_SIZE);
+    if(aa == 0 && packet > 1)
+    {
+        for(size_t x = x0; x < x1; x += packet)
+            render_packet(job, y, x, MIN((size_t)packet, x1 - x), &rays[x - x0], infos);
+        return;
+    }
+
+    for(size_t x = x0; x < x1; x++)
+    {
+        // With no Anti-Aliasing
+        if(aa == 0)
         {
-            for(size_t x = 0; x < fb->width; x++)
-            {
-                color_buffer = (struct color_t){0.0};
-                for(size_t a = 0; a < aa; a++)
-                {
-                    FORM_RAY(x + randf(), y + randf())
-                    struct color_t global_ilumn_buffer = {0.0};
-                    for(size_t s = 0; s < scene->samples; s++)
-                    {
-                        struct color_t c;
-                        raytrace(&ray, scene, camera, &c, NULL);
-                        global_ilumn_buffer = add_color(global_ilumn_buffer, c);
-                    }
-                    global_ilumn_buffer = scale_color(global_ilumn_buffer, 1/scene->samples);
-                    
-                    color_buffer = add_color(global_ilumn_buffer, color_buffer);
+            seed_sample(job, y * fb->width + x, 0);
+            color_buffer = render_sample(job, &rays[x - x0], y * fb->width + x, 0);
+            fb->pixels[y * fb->width + x] = color_to_pixel(color_buffer);
+            continue;
+        }
 
-#ifdef LOG_RAYS
-                LOG_RAYS_PRINT()
-#endif
-                }
-                
-                color_buffer = scale_color(color_buffer, aa_scale);
-                fb->pixels[y * fb->width + x] = color_to_pixel(color_buffer); 
-            }
+        color_buffer = (struct color_t){0.0};
+        for(size_t a = 0; a < aa; a++)
+        {
+            seed_sample(job, y * fb->width + x, a * job->scene->samples);
+            sampler_get(&sampler, SAMPLER_DIM_PIXEL, a, aa, 2, jitter);
+            camera_ray(job, x + jitter[0], y + jitter[1], &ray);
+            color_buffer = add_color(render_sample(job, &ray, y * fb->width + x, a * job->scene->samples), color_buffer);
         }
+
+        color_buffer = scale_color(color_buffer, aa_scale);
+        fb->pixels[y * fb->width + x] = color_to_pixel(color_buffer);
     }
+}
 
-    // With no Anti-Aliasing
-    else
+// Renders tile on thread worker. Whatever the rows need to keep their
+// rays and hits on comes from the scratch of that thread, which gets
+// reset before every tile
+static void
+render_tile(struct render_job_t *job, int worker, struct tile_t *tile)
+{
+    struct scratch_t *scratch = &job->ctx->scratch[worker];
+    struct ray_t *rays = NULL;
+    struct hit_info_t *infos = NULL;
+    struct tile_t rest;
+
+    rays = (struct ray_t *)scratch_alloc(scratch, (tile->x1 - tile->x0) * sizeof(struct ray_t));
+    infos = (struct hit_info_t *)scratch_alloc(scratch, RAYTRACER_MAX_PACKET_SIZE * sizeof(struct hit_info_t));
+
+    for(size_t y = tile->y0; y < tile->y1; y++)
     {
-        for(size_t y = 0; y < fb->height; y++)
+        // If someone ran out of work while we are still here, this tile
+        // is taking longer than the rest. Give away the bottom half
+        // of what's left of it
+        if(tile->y1 - y >= 2 * RAYTRACER_MIN_TILE_SIZE && scheduler_should_split(&job->ctx->scheduler))
         {
-            for(size_t x = 0; x < fb->width; x++)
-            {
-                FORM_RAY(x, y)
-                struct color_t global_ilumn_buffer = {0.0};
-                for(size_t s = 0; s < scene->samples; s++)
-                {
-                    struct color_t c;
-                    raytrace(&ray, scene, camera, &c, NULL);
-                    global_ilumn_buffer = add_color(global_ilumn_buffer, c);
-                }
-                global_ilumn_buffer = scale_color(global_ilumn_buffer, 1/scene->samples);
-                fb->pixels[y * fb->width + x] = color_to_pixel(global_ilumn_buffer); 
+            rest = *tile;
+            rest.y0 = y + (tile->y1 - y)/2;
+            tile->y1 = rest.y0;
+            scheduler_push(&job->ctx->scheduler, worker, &rest);
+        }
+
+        render_row(job, y, tile->x0, tile->x1, rays, infos);
+    }
 
 #ifdef LOG_RAYS
-                LOG_RAYS_PRINT()
+    size_t pixels = (tile->x1 - tile->x0) * (tile->y1 - tile->y0);
+    size_t rc = atomic_fetch_add(&job->rc, pixels) + pixels;
+    printf("\r[%lu out of %lu] (%f%%)", rc, job->max_rc,
+            ((float)rc/(float)job->max_rc)*100.0);
 #endif
-            }
-        }
+}
+
+// Keeps grabbing tiles until there are none left
+static void
+render_worker(void *arg, int id)
+{
+    struct tile_t tile;
+    struct render_job_t *job = (struct render_job_t *)arg;
+    struct scheduler_t *scheduler = &job->ctx->scheduler;
+
+    rays_traced = 0;
+    while(scheduler_next(scheduler, id, &tile))
+    {
+        scratch_reset(&job->ctx->scratch[id]);
+        render_tile(job, id, &tile);
+        scheduler_done(scheduler);
+    }
+    atomic_fetch_add(&job->rays, rays_traced);
+}
+
+// Resolves the number of threads requested on opts
+int
+raytracer_thread_count(struct raytracer_opts_t *opts)
+{
+    long cpus = 0;
+
+    if(opts != NULL && opts->threads > 0)
+        return opts->threads;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+void
+raytracer_context_init(struct render_context_t *ctx, struct raytracer_opts_t *opts, int height, int width)
+{
+    double start = time_ms();
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->thread_count = pool_init(&ctx->pool, raytracer_thread_count(opts));
+    if(ctx->thread_count < raytracer_thread_count(opts))
+        wrn("could only start %d out of %d render threads", ctx->thread_count, raytracer_thread_count(opts));
+
+    scheduler_init(&ctx->scheduler, ctx->thread_count);
+    ctx->scratch = (struct scratch_t *)calloc(ctx->thread_count, sizeof(struct scratch_t));
+    new_framebuffer(height, width, &ctx->fb);
+
+    ctx->setup_ms = time_ms() - start;
+    inf("render context ready with %d threads (%.3f ms)", ctx->thread_count, ctx->setup_ms);
+}
+
+void
+raytracer_context_destroy(struct render_context_t *ctx)
+{
+    double start = time_ms();
+
+    pool_destroy(&ctx->pool);
+    scheduler_destroy(&ctx->scheduler);
+    for(int i = 0; i < ctx->thread_count; i++)
+        scratch_free(&ctx->scratch[i]);
+    free(ctx->scratch);
+    free_framebuffer(&ctx->fb);
+
+    // Had every frame set all this up (and tear it down) by
+    // itself, it would have paid for it every time
+    ctx->setup_ms += time_ms() - start;
+    if(ctx->frames > 1)
+        inf("reused render context for %lu frames, saving around %.3f ms of setup",
+            ctx->frames, ctx->setup_ms * (ctx->frames - 1));
+
+    ctx->scratch = NULL;
+    ctx->thread_count = 0;
+}
+
+// Renders scene into ctx->fb
+void
+raytracer_render(struct render_context_t *ctx, struct scene_t *scene, struct camera_t *camera)
+{
+    size_t tiles_x = 0, tiles_y = 0, tile_count = 0, rays = 0;
+    double start = time_ms(), elapsed = 0.0;
+    struct framebuffer_t *fb = &ctx->fb;
+    struct render_job_t job = {0};
+    struct tile_t tile;
+
+    job.ctx = ctx;
+    atomic_init(&job.rays, 0);
+    job.scene = scene;
+    job.camera = camera;
+    job.fb = fb;
+    job.ratio =1.0/( (float)fb->width/(float)fb->width);
+
+    // Get parameters from camera
+    if(camera->opts == NULL)
+        job.opts = &DEFAULT_OPTS;
+    else
+        job.opts = (struct raytracer_opts_t *)camera->opts;
+
+    job.scale = tan(deg2rad(job.opts->fov/2.0));
+    job.seed = rng_hash(job.opts->seed, ctx->frames);
+    camera_rays_init(&job);
+
+    if(scene->samples < 1)
+        scene->samples = 1;
+    job.samples = MAX(job.opts->aa, 1) * scene->samples;
+
+    // Objects and meshes might have moved since the last frame
+    build_scene_bvh(scene);
+
+    tiles_x = (fb->width + RAYTRACER_TILE_SIZE - 1)/RAYTRACER_TILE_SIZE;
+    tiles_y = (fb->height + RAYTRACER_TILE_SIZE - 1)/RAYTRACER_TILE_SIZE;
+    tile_count = tiles_x * tiles_y;
+
+    // Split the framebuffer into tiles and give each thread
+    // a contiguous run of them to start with. Anyone who runs
+    // out will steal from the others
+    for(size_t i = tile_count; i > 0; i--)
+    {
+        tile.x0 = ((i - 1) % tiles_x) * RAYTRACER_TILE_SIZE;
+        tile.y0 = ((i - 1) / tiles_x) * RAYTRACER_TILE_SIZE;
+        tile.x1 = MIN(tile.x0 + RAYTRACER_TILE_SIZE, (size_t)fb->width);
+        tile.y1 = MIN(tile.y0 + RAYTRACER_TILE_SIZE, (size_t)fb->height);
+        scheduler_push(&ctx->scheduler, ((i - 1) * ctx->thread_count)/tile_count, &tile);
     }
 
+#ifdef LOG_RAYS
+    atomic_init(&job.rc, 0);
+    job.max_rc = fb->height * fb->width;
+    inf("Rays shot: ");
+#endif
+
+    pool_run(&ctx->pool, render_worker, &job);
+    ctx->frames++;
+
+    elapsed = time_ms() - start;
+    rays = atomic_load(&job.rays);
+    inf("frame rendered in %.3f ms, %lu rays traced (%.3f Mrays/s)",
+        elapsed, rays, elapsed > 0.0 ? rays / (elapsed * 1000.0) : 0.0);
+
     // Just so the next log won't overlap the ray count
 #ifdef LOG_RAYS
     printf("\n");
 #endif
 
-
     // Gotta clean after myself!
-#undef LOG_RAYS_PRINT
 #undef LOG_RAYS
 }
@@ -3,9 +3,31 @@
 
 #include "renderer.h"
 #include "geometry.h"
+#include "scheduler.h"
+#include "sampler.h"
+#include "pool.h"
 
-#define RAYTRACER_DEFAULT_FOV   90.0
-#define RAYTRACER_DEFAULT_DEPTH 12
+#define RAYTRACER_DEFAULT_FOV       90.0
+#define RAYTRACER_DEFAULT_DEPTH     12
+
+// 0 means one thread per online CPU
+#define RAYTRACER_DEFAULT_THREADS   0
+#define RAYTRACER_DEFAULT_SEED      0
+#define RAYTRACER_DEFAULT_SAMPLER   SAMPLER_SOBOL
+
+// Width and height (in pixels) of the tiles the
+// framebuffer gets split into. Tiles that turn out to be
+// expensive are split further, but never below
+// RAYTRACER_MIN_TILE_SIZE rows
+#define RAYTRACER_TILE_SIZE         32
+#define RAYTRACER_MIN_TILE_SIZE     2
+
+// Primary rays of this many pixels in a row get traced together.
+// 0 or 1 traces every ray on its own
+#ifndef RAYTRACER_DEFAULT_PACKET_SIZE
+#define RAYTRACER_DEFAULT_PACKET_SIZE   8
+#endif
+#define RAYTRACER_MAX_PACKET_SIZE       16
 
 struct raytracer_opts_t
 {
@@ -13,8 +35,45 @@ struct raytracer_opts_t
     int aa;
 
     int depth;
+
+    // Number of threads used to render a frame, and the
+    // seed used to generate the random numbers for each
+    // pixel
+    int threads;
+    uint32_t seed;
+
+    // How those random numbers get spread over the samples
+    // of a pixel (see sampler.h)
+    enum sampler_type_t sampler;
+
+    // See RAYTRACER_DEFAULT_PACKET_SIZE. Only used without
+    // anti-aliasing, and never above RAYTRACER_MAX_PACKET_SIZE
+    int packet_size;
 };
 
-void raytracer_render(struct scene_t *scene, struct camera_t *camera,  struct framebuffer_t *fb);
+// Everything a render needs that doesn't depend on the scene. Meant
+// to be created once and then reused for every frame, so the
+// threads and buffers aren't set up again for each one of them
+struct render_context_t
+{
+    struct pool_t pool;
+    struct scheduler_t scheduler;
+    struct scratch_t *scratch;
+    int thread_count;
+
+    struct framebuffer_t fb;
+
+    // How long it took to set the context up, and how many
+    // frames have been rendered with it
+    double setup_ms;
+    size_t frames;
+};
+
+int raytracer_thread_count(struct raytracer_opts_t *opts);
+
+void raytracer_context_init(struct render_context_t *ctx, struct raytracer_opts_t *opts, int height, int width);
+void raytracer_context_destroy(struct render_context_t *ctx);
+
+void raytracer_render(struct render_context_t *ctx, struct scene_t *scene, struct camera_t *camera);
 
 #endif
@@ -22,6 +22,162 @@ make_scene(struct color_t * ai, struct scene_t *s)
     s->ai = *ai;
 }
 
+// Tag of a bvh ref, for sorting leaves by type
+#define REF_TYPE(r)             ((r) & SCENE_REF_TYPE)
+
+static void
+alloc_sphere_list(struct sphere_list_t *l, size_t count)
+{
+    l->cx = (float *)malloc((count + 1) * 4 * sizeof(float));
+    l->cy = l->cx + count + 1;
+    l->cz = l->cy + count + 1;
+    l->radius2 = l->cz + count + 1;
+    l->objects = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    l->count = 0;
+}
+
+static void
+alloc_plane_list(struct plane_list_t *l, size_t count)
+{
+    l->px = (float *)malloc((count + 1) * 6 * sizeof(float));
+    l->py = l->px + count + 1;
+    l->pz = l->py + count + 1;
+    l->nx = l->pz + count + 1;
+    l->ny = l->nx + count + 1;
+    l->nz = l->ny + count + 1;
+    l->objects = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    l->count = 0;
+}
+
+// Builds the top level bvh of scene. Meshes go in with the
+// (world space) bounds of their own bvh, so they must be up
+// to date. Spheres and planes are compiled into their own
+// lists on the way, so the raytracer can go through them
+// without looking at what type each object is
+void
+build_scene_bvh(struct scene_t *s)
+{
+    size_t count = 0;
+    struct aabb_t *boxes = NULL;
+    uint32_t *refs = NULL, *indices = NULL, ref = 0, k = 0;
+    struct gobject_t *o = NULL;
+    struct bvh_node_t *n = NULL;
+    struct sphere_list_t *sl = &s->spheres;
+    struct plane_list_t *pl = &s->planes;
+
+    free_scene_bvh(s);
+
+    boxes = (struct aabb_t *)malloc((s->objects_count + s->mesh_count + 1) * sizeof(struct aabb_t));
+    refs = (uint32_t *)malloc((s->objects_count + s->mesh_count + 1) * sizeof(uint32_t));
+    alloc_sphere_list(sl, s->objects_count);
+    alloc_plane_list(pl, s->objects_count);
+
+    for(size_t i = 0; i < s->objects_count; i++)
+    {
+        o = &s->objects[i];
+        switch(o->type)
+        {
+            case GEOMETRY_SPHERE:
+            case GEOMETRY_DISK:
+                // Good enough for disks too, even if a bit loose
+                boxes[count] = (struct aabb_t){
+                    .min = {o->center.x - o->radius, o->center.y - o->radius, o->center.z - o->radius},
+                    .max = {o->center.x + o->radius, o->center.y + o->radius, o->center.z + o->radius}
+                };
+                refs[count++] = (o->type == GEOMETRY_SPHERE ? SCENE_REF_SPHERE : SCENE_REF_OBJECT) | i;
+                break;
+
+            case GEOMETRY_TRIANGLE:
+                boxes[count] = (struct aabb_t){
+                    .min = {
+                        MIN(o->edges[0].x, MIN(o->edges[1].x, o->edges[2].x)),
+                        MIN(o->edges[0].y, MIN(o->edges[1].y, o->edges[2].y)),
+                        MIN(o->edges[0].z, MIN(o->edges[1].z, o->edges[2].z))
+                    },
+                    .max = {
+                        MAX(o->edges[0].x, MAX(o->edges[1].x, o->edges[2].x)),
+                        MAX(o->edges[0].y, MAX(o->edges[1].y, o->edges[2].y)),
+                        MAX(o->edges[0].z, MAX(o->edges[1].z, o->edges[2].z))
+                    }
+                };
+                refs[count++] = SCENE_REF_OBJECT | i;
+                break;
+
+            case GEOMETRY_PLANE:
+                pl->px[pl->count] = o->center.x;
+                pl->py[pl->count] = o->center.y;
+                pl->pz[pl->count] = o->center.z;
+                pl->nx[pl->count] = o->normal.x;
+                pl->ny[pl->count] = o->normal.y;
+                pl->nz[pl->count] = o->normal.z;
+                pl->objects[pl->count++] = i;
+                break;
+        }
+    }
+
+    for(size_t i = 0; i < s->mesh_count; i++)
+    {
+        if(s->meshes[i]->data->bvh.node_count == 0)
+            continue;
+
+        mesh_bounds(s->meshes[i], &boxes[count]);
+        refs[count++] = SCENE_REF_MESH | i;
+    }
+
+    // Point the leaves straight at objects and meshes, so the
+    // raytracer doesn't have to go through refs
+    bvh_build(&s->bvh, boxes, count);
+    indices = s->bvh.indices;
+    for(size_t i = 0; i < s->bvh.index_count; i++)
+        indices[i] = refs[indices[i]];
+
+    // Sort each leaf by type (they are tiny), so the spheres
+    // of a leaf all come first
+    for(size_t i = 0; i < s->bvh.node_count; i++)
+    {
+        n = &s->bvh.nodes[i];
+        for(uint32_t j = n->first + 1; n->count > 0 && j < n->first + n->count; j++)
+        {
+            ref = indices[j];
+            for(k = j; k > n->first && REF_TYPE(indices[k - 1]) > REF_TYPE(ref); k--)
+                indices[k] = indices[k - 1];
+            indices[k] = ref;
+        }
+    }
+
+    // Then lay the spheres out in the order the leaves are in,
+    // which gives each leaf a run of consecutive spheres
+    for(size_t i = 0; i < s->bvh.index_count; i++)
+    {
+        if(REF_TYPE(indices[i]) != SCENE_REF_SPHERE)
+            continue;
+
+        o = &s->objects[indices[i] & SCENE_REF_INDEX];
+        sl->cx[sl->count] = o->center.x;
+        sl->cy[sl->count] = o->center.y;
+        sl->cz[sl->count] = o->center.z;
+        sl->radius2[sl->count] = o->radius2;
+        sl->objects[sl->count] = indices[i] & SCENE_REF_INDEX;
+        indices[i] = SCENE_REF_SPHERE | sl->count++;
+    }
+
+    free(boxes);
+    free(refs);
+}
+
+void
+free_scene_bvh(struct scene_t *s)
+{
+    bvh_free(&s->bvh);
+    free(s->spheres.cx);
+    free(s->spheres.objects);
+    free(s->planes.px);
+    free(s->planes.objects);
+
+    s->spheres = (struct sphere_list_t){0};
+    s->planes = (struct plane_list_t){0};
+}
+
 // Initialize camera with identity matrix
 void
 make_camera(struct pv_t *look_at, struct pv_t *up, struct pv_t *orig, struct camera_t *c)
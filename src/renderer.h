@@ -70,6 +70,37 @@ struct light_t
     float xlimits[2], ylimits[2], zlimits[2];
 };
 
+// What the leaves of a scene's bvh point at. The top two bits say
+// what kind of thing it is and the rest where to find it: spheres
+// are on scene->spheres, objects on scene->objects and meshes on
+// scene->meshes
+#define SCENE_REF_SPHERE        0x00000000u
+#define SCENE_REF_OBJECT        0x40000000u
+#define SCENE_REF_MESH          0x80000000u
+#define SCENE_REF_TYPE          0xc0000000u
+#define SCENE_REF_INDEX         0x3fffffffu
+
+// The spheres of a scene, compiled by build_scene_bvh into arrays
+// that can be tested in bulk without looking at their type. They are
+// stored in the order the leaves of the bvh point at them, so each
+// leaf gets a run of consecutive ones
+struct sphere_list_t
+{
+    float *cx, *cy, *cz, *radius2;
+
+    // Where each one came from on scene->objects
+    uint32_t *objects;
+    size_t count;
+};
+
+// Same for planes, which are a point and a normal
+struct plane_list_t
+{
+    float *px, *py, *pz, *nx, *ny, *nz;
+    uint32_t *objects;
+    size_t count;
+};
+
 struct scene_t
 {
     struct gobject_t *objects;
@@ -81,6 +112,14 @@ struct scene_t
     struct light_t *lights;
     size_t light_count;
 
+    // Built over objects and meshes by build_scene_bvh. Leaves
+    // point at spheres, other objects or meshes (see SCENE_REF_*),
+    // sorted in that order. Planes don't fit in a box, so they are
+    // kept on their own list instead
+    struct bvh_t bvh;
+    struct sphere_list_t spheres;
+    struct plane_list_t planes;
+
     float shadow_bias;
     struct color_t ai;
 
@@ -113,6 +152,8 @@ struct camera_t
 const char* color_to_str(struct color_t *c);
 
 void make_scene(struct color_t *ai, struct scene_t *scene);
+void build_scene_bvh(struct scene_t *scene);
+void free_scene_bvh(struct scene_t *scene);
 
 void make_camera(struct pv_t *look_at, struct pv_t *up, struct pv_t *orig, struct camera_t *c);
 void transform_camera(struct camera_t *c, matrix_t m, struct camera_t *r);
@@ -0,0 +1,243 @@
+#include "sampler.h"
+#include "fmath.h"
+
+// Sobol direction numbers of dimensions 1 to 3 (0 is just the bits
+// of the index reversed), from Joe and Kuo
+static const uint32_t
+SOBOL_DIRECTIONS[SAMPLER_MAX_DIMS - 1][32] =
+{
+    {
+        0x80000000, 0xc0000000, 0xa0000000, 0xf0000000,
+        0x88000000, 0xcc000000, 0xaa000000, 0xff000000,
+        0x80800000, 0xc0c00000, 0xa0a00000, 0xf0f00000,
+        0x88880000, 0xcccc0000, 0xaaaa0000, 0xffff0000,
+        0x80008000, 0xc000c000, 0xa000a000, 0xf000f000,
+        0x88008800, 0xcc00cc00, 0xaa00aa00, 0xff00ff00,
+        0x80808080, 0xc0c0c0c0, 0xa0a0a0a0, 0xf0f0f0f0,
+        0x88888888, 0xcccccccc, 0xaaaaaaaa, 0xffffffff
+    },
+    {
+        0x80000000, 0xc0000000, 0x60000000, 0x90000000,
+        0xe8000000, 0x5c000000, 0x8e000000, 0xc5000000,
+        0x68800000, 0x9cc00000, 0xee600000, 0x55900000,
+        0x80680000, 0xc09c0000, 0x60ee0000, 0x90550000,
+        0xe8808000, 0x5cc0c000, 0x8e606000, 0xc5909000,
+        0x6868e800, 0x9c9c5c00, 0xeeee8e00, 0x5555c500,
+        0x8000e880, 0xc0005cc0, 0x60008e60, 0x9000c590,
+        0xe8006868, 0x5c009c9c, 0x8e00eeee, 0xc5005555
+    },
+    {
+        0x80000000, 0xc0000000, 0x20000000, 0x50000000,
+        0xf8000000, 0x74000000, 0xa2000000, 0x93000000,
+        0xd8800000, 0x25400000, 0x59e00000, 0xe6d00000,
+        0x78080000, 0xb40c0000, 0x82020000, 0xc3050000,
+        0x208f8000, 0x51474000, 0xfbea2000, 0x75d93000,
+        0xa0858800, 0x914e5400, 0xdbe79e00, 0x25db6d00,
+        0x58800080, 0xe54000c0, 0x79e00020, 0xb6d00050,
+        0x800800f8, 0xc00c0074, 0x200200a2, 0x50050093
+    }
+};
+
+// Halton bases of each dimension
+static const uint32_t
+HALTON_BASES[SAMPLER_MAX_DIMS] = {2, 3, 5, 7};
+
+void
+sampler_init(struct sampler_t *s, enum sampler_type_t type, uint32_t seed, uint32_t index, uint32_t count)
+{
+    s->type = type;
+    s->seed = seed;
+    s->index = index;
+    s->count = count > 0 ? count : 1;
+}
+
+// Number on [0, 1) out of x. Only keeps as many bits as a float can
+// hold, otherwise it might round up to 1.0
+static inline float
+to_float(uint32_t x)
+{
+    return (float)(x >> 8) * (1.0f/16777216.0f);
+}
+
+// Keeps r below 1.0, rounding might get it there
+static inline float
+below_one(float r)
+{
+    return r < 0x1.fffffep-1f ? r : 0x1.fffffep-1f;
+}
+
+// Random permutation of [0, l), picked by p, applied to i. Taken from
+// Kensler's "Correlated Multi-Jittered Sampling"
+static uint32_t
+permute(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+
+    if(l <= 1)
+        return 0;
+
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+
+    // Permutes [0, w], and just tries again for anything past l
+    do
+    {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    }
+    while(i >= l);
+
+    return (i + p) % l;
+}
+
+static inline uint32_t
+reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of x (as a fraction of 2^32). Each bit gets flipped
+// or not depending on seed and the bits above it, which keeps the
+// points just as well spread out. Burley's version of Laine and
+// Karras' hash, which works on the bits backwards
+static inline uint32_t
+owen_scramble(uint32_t x, uint32_t seed)
+{
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverse_bits(x);
+}
+
+static inline uint32_t
+sobol(uint32_t index, int dim)
+{
+    uint32_t x = 0;
+
+    if(dim == 0)
+        return reverse_bits(index);
+
+    for(int bit = 0; index != 0; bit++, index >>= 1)
+        if(index & 1)
+            x ^= SOBOL_DIRECTIONS[dim - 1][bit];
+
+    return x;
+}
+
+// Radical inverse of index on base, with each digit going through
+// its own permutation, picked by seed and the digits before it (Owen
+// scrambling again). Digits past the last one of index are 0, but they
+// still get scrambled, which makes every one of them just a random
+// digit. Once past the ones that tell count points apart, all those
+// together are then just a random number
+static float
+halton(uint32_t index, uint32_t count, uint32_t base, uint32_t seed)
+{
+    const float inv = 1.0f/base;
+    float f = inv, r = 0.0f;
+    uint32_t digit = 0;
+
+    for(; index != 0 || f * count >= inv; f *= inv)
+    {
+        digit = index % base;
+        index /= base;
+        r += permute(digit, base, seed) * f;
+        seed = rng_hash(seed, digit);
+    }
+
+    return below_one(r + to_float(seed) * f * base);
+}
+
+// Point i of a count points correlated multi-jittered pattern picked
+// by p. Those are on a m by n grid that's just big enough, with every
+// row and column having exactly one of them. Kensler again
+static void
+cmj(uint32_t i, uint32_t count, uint32_t p, float *x, float *y)
+{
+    uint32_t m = (uint32_t)sqrtf((float)count), n = 0, sx = 0, sy = 0;
+
+    if(m == 0)
+        m = 1;
+    n = (count + m - 1)/m;
+
+    sx = permute(i % m, m, p * 0xa511e9b3);
+    sy = permute(i / m, n, p * 0x63d83595);
+    *x = ((i % m) + (sy + to_float(rng_hash(p * 0xa399d265, i)))/n)/m;
+    *y = ((i / m) + (sx + to_float(rng_hash(p * 0x711ad6a5, i)))/m)/n;
+}
+
+void
+sampler_get(const struct sampler_t *s, uint32_t dim, uint32_t index, uint32_t count, int n, float *r)
+{
+    uint32_t key = rng_hash(s->seed, dim), i = 0, j = 0;
+    int k = 0;
+
+    if(count == 0)
+        count = 1;
+    if(n > SAMPLER_MAX_DIMS)
+        n = SAMPLER_MAX_DIMS;
+
+    // Every dimension gives its points out in its own order, so
+    // they have nothing to do with the ones of other dimensions
+    // for the same sample
+    i = permute(index % count, count, key);
+
+    switch(s->type)
+    {
+        case SAMPLER_STRATIFIED:
+            if(n >= 2)
+            {
+                cmj(i, count, key, &r[0], &r[1]);
+                k = 2;
+            }
+
+            // The rest are just stratified on their own
+            for(; k < n; k++)
+            {
+                j = permute(i, count, rng_hash(key, k));
+                r[k] = below_one((j + to_float(rng_hash(key ^ 0x2545f491, k * count + i)))/count);
+            }
+            break;
+
+        case SAMPLER_HALTON:
+            for(k = 0; k < n; k++)
+                r[k] = halton(i, count, HALTON_BASES[k], rng_hash(key, k));
+            break;
+
+        case SAMPLER_SOBOL:
+            for(k = 0; k < n; k++)
+                r[k] = to_float(owen_scramble(sobol(i, k), rng_hash(key, k)));
+            break;
+
+        default:
+            for(k = 0; k < n; k++)
+                r[k] = to_float(rng_hash(rng_hash(key, k), index));
+            break;
+    }
+}
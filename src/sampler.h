@@ -0,0 +1,54 @@
+#ifndef SAMPLER_H__
+#define SAMPLER_H__
+
+#include "utilities.h"
+
+// How the random numbers of a pixel's samples are picked. Random is
+// plain (counter based) white noise, the rest spread each pixel's
+// samples out evenly, so fewer of them get the same noise
+enum sampler_type_t
+{
+    SAMPLER_RANDOM,
+    // Correlated multi-jittered, needs to know how many samples
+    // there are going to be
+    SAMPLER_STRATIFIED,
+    SAMPLER_HALTON,
+    // Sobol with Owen scrambling
+    SAMPLER_SOBOL
+};
+
+// Each thing a sample needs random numbers for gets its own dimension,
+// which is scrambled and shuffled on its own. That way those don't have
+// to agree on how many numbers each one takes, and none of them ends up
+// on the high (and worse) dimensions of a sequence. Each one of them
+// takes up to SAMPLER_MAX_DIMS numbers at a time
+#define SAMPLER_MAX_DIMS                4
+
+// Jitter inside the pixel
+#define SAMPLER_DIM_PIXEL               0
+// Direction of the global illumination ray of bounce depth
+#define SAMPLER_DIM_GI(depth)           (1 + 2 * (uint32_t)(depth))
+// Point on area light light, at bounce depth
+#define SAMPLER_DIM_LIGHT(depth, light) (2 + 2 * (uint32_t)(depth) + ((uint32_t)(light) << 16))
+
+// Where a sample is on the sequence of its pixel
+struct sampler_t
+{
+    enum sampler_type_t type;
+
+    // Different for every pixel (and frame)
+    uint32_t seed;
+
+    // This is sample index out of count
+    uint32_t index, count;
+};
+
+void sampler_init(struct sampler_t *s, enum sampler_type_t type, uint32_t seed, uint32_t index, uint32_t count);
+
+// Fills r with the n (up to SAMPLER_MAX_DIMS) numbers on [0, 1) of
+// dimension dim for sample index out of count. Things that take more
+// than one sample each time a sample gets there (like area lights)
+// use their own index and count, the rest take the ones of s
+void sampler_get(const struct sampler_t *s, uint32_t dim, uint32_t index, uint32_t count, int n, float *r);
+
+#endif
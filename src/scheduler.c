@@ -0,0 +1,184 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "scheduler.h"
+
+static void
+deque_init(struct tile_deque_t *d)
+{
+    pthread_mutex_init(&d->lock, NULL);
+    d->tiles = NULL;
+    d->head = d->tail = d->reserved = 0;
+}
+
+static void
+deque_destroy(struct tile_deque_t *d)
+{
+    pthread_mutex_destroy(&d->lock);
+    free(d->tiles);
+    d->tiles = NULL;
+    d->head = d->tail = d->reserved = 0;
+}
+
+// Only call with d->lock held
+static void
+deque_make_room(struct tile_deque_t *d)
+{
+    if(d->tail < d->reserved)
+        return;
+
+    // Reuse the space left behind by thieves before asking for more
+    if(d->head > 0)
+    {
+        memmove(d->tiles, &d->tiles[d->head], (d->tail - d->head) * sizeof(struct tile_t));
+        d->tail -= d->head;
+        d->head = 0;
+        return;
+    }
+
+    d->reserved = d->reserved > 0 ? d->reserved * 2 : 16;
+    d->tiles = (struct tile_t *)realloc(d->tiles, d->reserved * sizeof(struct tile_t));
+}
+
+static bool
+deque_pop(struct scheduler_t *s, struct tile_deque_t *d, struct tile_t *tile)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->tail > d->head)
+    {
+        *tile = d->tiles[--d->tail];
+        atomic_fetch_sub(&s->queued, 1);
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+static bool
+deque_steal(struct scheduler_t *s, struct tile_deque_t *d, struct tile_t *tile)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&d->lock);
+    if(d->tail > d->head)
+    {
+        *tile = d->tiles[d->head++];
+        atomic_fetch_sub(&s->queued, 1);
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+void
+scheduler_init(struct scheduler_t *s, int worker_count)
+{
+    s->worker_count = worker_count > 0 ? worker_count : 1;
+    s->deques = (struct tile_deque_t *)calloc(s->worker_count, sizeof(struct tile_deque_t));
+    for(int i = 0; i < s->worker_count; i++)
+        deque_init(&s->deques[i]);
+
+    atomic_init(&s->pending, 0);
+    atomic_init(&s->idle, 0);
+    atomic_init(&s->queued, 0);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->wake, NULL);
+}
+
+void
+scheduler_destroy(struct scheduler_t *s)
+{
+    for(int i = 0; i < s->worker_count; i++)
+        deque_destroy(&s->deques[i]);
+    free(s->deques);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->wake);
+
+    s->deques = NULL;
+    s->worker_count = 0;
+}
+
+// Adds tile to the deque owned by worker
+void
+scheduler_push(struct scheduler_t *s, int worker, struct tile_t *tile)
+{
+    struct tile_deque_t *d = &s->deques[worker % s->worker_count];
+
+    // Count it before anyone can grab it, so pending can't
+    // hit 0 while this tile is still around
+    atomic_fetch_add(&s->pending, 1);
+
+    pthread_mutex_lock(&d->lock);
+    deque_make_room(d);
+    d->tiles[d->tail++] = *tile;
+    pthread_mutex_unlock(&d->lock);
+
+    // Someone might have stolen it already, which takes queued
+    // below 0 for a bit. Either way a sleeping worker can go look
+    pthread_mutex_lock(&s->lock);
+    atomic_fetch_add(&s->queued, 1);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Gets the next tile for worker. Takes one from its own deque
+// if it can, otherwise it goes around stealing from the others.
+// When there's nothing to steal it sleeps until someone pushes a
+// tile (those still working split theirs when others are idle), or
+// until every tile is done, in which case it returns false
+bool
+scheduler_next(struct scheduler_t *s, int worker, struct tile_t *tile)
+{
+    int victim = 0;
+    bool done = false;
+
+    if(deque_pop(s, &s->deques[worker], tile))
+        return true;
+
+    atomic_fetch_add(&s->idle, 1);
+    while(!done)
+    {
+        for(int i = 1; i <= s->worker_count; i++)
+        {
+            victim = (worker + i) % s->worker_count;
+            if(deque_steal(s, &s->deques[victim], tile))
+            {
+                atomic_fetch_sub(&s->idle, 1);
+                return true;
+            }
+        }
+
+        pthread_mutex_lock(&s->lock);
+        while(atomic_load(&s->queued) <= 0 && atomic_load(&s->pending) > 0)
+            pthread_cond_wait(&s->wake, &s->lock);
+        done = atomic_load(&s->pending) == 0;
+        pthread_mutex_unlock(&s->lock);
+    }
+    atomic_fetch_sub(&s->idle, 1);
+
+    return false;
+}
+
+// Marks a tile returned by scheduler_next as finished. The last
+// one wakes everyone up so they can see there's nothing left
+void
+scheduler_done(struct scheduler_t *s)
+{
+    if(atomic_fetch_sub(&s->pending, 1) > 1)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    pthread_cond_broadcast(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Whether the tile currently being worked on should be split, 
+// which is only worth doing if someone is waiting for work
+bool
+scheduler_should_split(struct scheduler_t *s)
+{
+    return atomic_load_explicit(&s->idle, memory_order_relaxed) > 0;
+}
@@ -0,0 +1,52 @@
+#ifndef SCHEDULER_H__
+#define SCHEDULER_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "utilities.h"
+
+// Rectangular region of a framebuffer, from (x0, y0) up
+// to (but not including) (x1, y1)
+struct tile_t
+{
+    size_t x0, y0, x1, y1;
+};
+
+// Each worker owns one of these. The owner pushes and pops
+// from the tail, everyone else steals from the head
+struct tile_deque_t
+{
+    pthread_mutex_t lock;
+
+    struct tile_t *tiles;
+    size_t head, tail, reserved;
+};
+
+struct scheduler_t
+{
+    struct tile_deque_t *deques;
+    int worker_count;
+
+    // Tiles that have been pushed but not finished yet, and
+    // workers that are currently looking for something to do
+    atomic_size_t pending;
+    atomic_int idle;
+
+    // Tiles sitting on some deque. Workers that can't find any
+    // sleep on wake until there's one, or until nothing's pending
+    atomic_int queued;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+void scheduler_init(struct scheduler_t *s, int worker_count);
+void scheduler_destroy(struct scheduler_t *s);
+
+void scheduler_push(struct scheduler_t *s, int worker, struct tile_t *tile);
+bool scheduler_next(struct scheduler_t *s, int worker, struct tile_t *tile);
+void scheduler_done(struct scheduler_t *s);
+
+bool scheduler_should_split(struct scheduler_t *s);
+
+#endif
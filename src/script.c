@@ -13,11 +13,8 @@
 
 // I'll be using static allocations for the submission
 // but in the future I'll make this dynamic
-#define MAX_INSTRUCTION_BUFFER              100
 #define MAX_LINE_BUFFER                     256
-#define MAX_INSTRUCTION_BUFFER              100
 #define MAX_VARIABLE_BUFFER                 100
-#define MAX_MESH_COUNT                      10
 #define MAX_LIGHT_COUNT                     10
 
 #define DEFAULT_WIDTH                       640
@@ -38,20 +35,26 @@ static char *project_name = NULL;
 static int pc = 0;
 
 struct variable_t variable_buffer[MAX_VARIABLE_BUFFER] = {0};
-struct instruction_t instruction_buffer[MAX_INSTRUCTION_BUFFER] = {0};
+struct instruction_t *instruction_buffer = NULL;
+static int instruction_capacity = 0;
 
-struct mesh_t mesh_buffer[MAX_MESH_COUNT] = {0};
-struct mesh_t *mesh_pointer_buffer[MAX_MESH_COUNT] = {0};
+// Meshes (and their materials) get allocated one by one, so
+// growing this doesn't move them around
+struct mesh_t **mesh_buffer = NULL;
+static int mesh_capacity = 0;
 
-struct gobject_t object_bufer[MAX_MESH_COUNT] = {0};
-struct gparams_t mesh_gparams_buffer[MAX_MESH_COUNT] = {0};
-struct gparams_t object_gparams_buffer[MAX_MESH_COUNT] = {0};
+// Objects and their materials. These move around when they
+// grow, so push_object points every object back at its own
+struct gobject_t *object_bufer = NULL;
+struct gparams_t *object_gparams_buffer = NULL;
+static int object_capacity = 0;
 
 struct light_t light_buffer[MAX_LIGHT_COUNT] = {0};
 
 struct camera_t camera = {0};
 struct scene_t scene = {0};
 struct raytracer_opts_t camera_opts = {0};
+struct render_context_t render_context = {0};
 
 static int height = DEFAULT_HEIGHT, width = DEFAULT_WIDTH;
 
@@ -61,11 +64,12 @@ static
 void run_instruction(struct instruction_t *instruction);
 
 void
-script_run_file(const char * file_path)
+script_run_file(const char * file_path, int threads)
 {
     struct pv_t look_at = {0}, up = {0}, origin = {0};
     size_t line_count = 0;
     char line_buffer[MAX_LINE_BUFFER] = {0};
+    char mode[SCRIPT_MAX_TEXT_BUFFER] = {0};
 
     // First parse the script file
     if(file_path == NULL)
@@ -79,7 +83,7 @@ script_run_file(const char * file_path)
     struct instruction_t inst = {0};
     
     // The line_count++ is just there to make sure the line count always increases
-    while(fgets(line_buffer, sizeof(line_buffer), fp) && instruction_count < MAX_INSTRUCTION_BUFFER && line_count++ >= 0)
+    while(fgets(line_buffer, sizeof(line_buffer), fp) && line_count++ >= 0)
     {
         if(strlen(line_buffer) < 2)
             continue;
@@ -116,8 +120,20 @@ script_run_file(const char * file_path)
         else if(sscanf(line_buffer, "color %s ( %s %s %s )", inst.name, inst.var[0], inst.var[1], inst.var[2]) == 4)
             inst.command = INSTRUCTION_COLOR;
         
-        else if(sscanf(line_buffer, "load %s %s", inst.type, inst.name) == 2)
+        else if(sscanf(line_buffer, "load %s %s %s", inst.type, inst.name, mode) == 2)
             inst.command = INSTRUCTION_LOAD;
+
+        // Indexed meshes get t set to 1, compressed ones to 2
+        else if(sscanf(line_buffer, "load %s %s %s", inst.type, inst.name, mode) == 3 && strcmp(mode, "indexed") == 0)
+        {
+            inst.command = INSTRUCTION_LOAD;
+            inst.t = 1.0f;
+        }
+        else if(sscanf(line_buffer, "load %s %s %s", inst.type, inst.name, mode) == 3 && strcmp(mode, "compressed") == 0)
+        {
+            inst.command = INSTRUCTION_LOAD;
+            inst.t = 2.0f;
+        }
         
         else if(sscanf(line_buffer, "translate %s (%f %f %f)", inst.name, &inst.x, &inst.y, &inst.z) == 4)
             inst.command = INSTRUCTION_TRANSLATE;
@@ -130,6 +146,11 @@ script_run_file(const char * file_path)
         else if(sscanf(line_buffer, "rotate %s (%s %s %s %s)", inst.name, inst.var[0], inst.var[1], inst.var[2], inst.var[3]) == 5)
             inst.command = INSTRUCTION_ROTATE;
 
+        else if(sscanf(line_buffer, "instance %s %s", inst.type, inst.name) == 2)
+            inst.command = INSTRUCTION_INSTANCE;
+        else if(sscanf(line_buffer, "update %s %s", inst.name, inst.type) == 2)
+            inst.command = INSTRUCTION_UPDATE;
+
         else if(sscanf(line_buffer, "assign %s %f", inst.name, &inst.t) == 2)
             inst.command = INSTRUCTION_ASSIGN;
         else if(sscanf(line_buffer, "add %s %f", inst.name, &inst.t) == 2)
@@ -151,6 +172,13 @@ script_run_file(const char * file_path)
         else
             fatal("line %ld: %s", line_count, line_buffer);
 
+        // Scripts that scatter lots of meshes around can get long
+        if(instruction_count >= instruction_capacity)
+        {
+            instruction_capacity = instruction_capacity > 0 ? instruction_capacity * 2 : 128;
+            instruction_buffer = (struct instruction_t *)realloc(instruction_buffer, instruction_capacity * sizeof(struct instruction_t));
+        }
+
         memcpy(&instruction_buffer[instruction_count++], &inst, sizeof(struct instruction_t));
         line_buffer[0] = '\0';
     }
@@ -160,6 +188,10 @@ script_run_file(const char * file_path)
     camera_opts.aa = 0;
     camera_opts.depth = 1;
     camera_opts.fov = 90.0f;
+    camera_opts.threads = threads;
+    camera_opts.seed = RAYTRACER_DEFAULT_SEED;
+    camera_opts.sampler = RAYTRACER_DEFAULT_SAMPLER;
+    camera_opts.packet_size = RAYTRACER_DEFAULT_PACKET_SIZE;
 
     up = PV(0.0f, 1.0f, 0.0f);
     look_at = PV(0.0f, 0.0f, -1.0f);
@@ -173,9 +205,6 @@ script_run_file(const char * file_path)
     scene.objects = object_bufer;
     scene.lights = light_buffer;
 
-    for(int i = 0; i < MAX_MESH_COUNT; i++)
-        mesh_pointer_buffer[i] = &mesh_buffer[i];
-    scene.meshes = mesh_pointer_buffer;
     
     scene.shadow_bias = 0.001;
     scene.area_light_n = 5;
@@ -192,6 +221,11 @@ script_run_file(const char * file_path)
     default_gparams.kd = 1;
     default_gparams.ks = 1;
 
+    // Threads and framebuffer are shared by every frame
+    raytracer_context_init(&render_context, &camera_opts, height, width);
+    bvh_set_pool(&render_context.pool);
+    geometry_set_pool(&render_context.pool);
+
     // Run the script
     for(pc =0; pc < instruction_count; pc++)
     {
@@ -202,7 +236,20 @@ script_run_file(const char * file_path)
     }
     
     for(int i = 0; i < mesh_count; i++)
-        free_mesh(&mesh_buffer[i]);
+    {
+        free_mesh(mesh_buffer[i]);
+        free(mesh_buffer[i]->param);
+        free(mesh_buffer[i]);
+    }
+    free(mesh_buffer);
+    free(object_bufer);
+    free(object_gparams_buffer);
+    free(instruction_buffer);
+    free_scene_bvh(&scene);
+
+    bvh_set_pool(NULL);
+    geometry_set_pool(NULL);
+    raytracer_context_destroy(&render_context);
 }
 
 static inline struct pv_t
@@ -211,31 +258,96 @@ vertex_to_pv(struct wvertex_t *v)
     return (struct pv_t){.x = v->x, .y = v->y, .z = v->z, .w = 1.0};
 }
 
-// Allocates an array of gobject_ts and saves the faces from wf to it as triangles
+// Saves the faces from wf as the triangles of mesh
 static size_t
-allocate_objects_from_wavefront(const struct wavefront_t *wf, struct mesh_t *mesh)
+allocate_objects_from_wavefront(const struct wavefront_t *wf, struct mesh_t *mesh, bool indexed, bool compressed)
 {
     size_t i = 0;
-    new_mesh(mesh, wf->faces.used);
     struct pv_t a, b, c;
+
+    // Indexed meshes keep the vertices and faces of the file as they are
+    if(indexed)
+    {
+        new_indexed_mesh(mesh, wf->vertices.used, wf->faces.used);
+        // wvertex_t is just x, y and z
+        set_mesh_vertices(mesh, (const float *)wf->vertices.data);
+        for(i = 0; i < wf->faces.used; i++)
+            set_mesh_face(mesh, i, wf->faces.data[i].v[0], wf->faces.data[i].v[1], wf->faces.data[i].v[2]);
+
+        mesh->data->single_sided = true;
+        if(compressed)
+            compress_mesh(mesh);
+        else
+            build_mesh_bvh(mesh);
+
+        return wf->faces.used;
+    }
+
+    new_mesh(mesh, wf->faces.used);
     for(i = 0; i < wf->faces.used; i++)
     {
         a = vertex_to_pv(&wf->vertices.data[wf->faces.data[i].v[0]]);
         b = vertex_to_pv(&wf->vertices.data[wf->faces.data[i].v[1]]);
         c = vertex_to_pv(&wf->vertices.data[wf->faces.data[i].v[2]]);
-        make_triangle(&a, &b, &c, &mesh->triangles[i]);
-        mesh->triangles[i].single_sided = true;
-        mesh->triangles[i].param = NULL;
+        set_mesh_triangle(mesh, i, &a, &b, &c);
     }
+    mesh->data->single_sided = true;
+    build_mesh_bvh(mesh);
+
     return wf->faces.used;
 }
 
+// Makes room for one more mesh, along with its material
+static struct mesh_t *
+push_mesh(const char *name)
+{
+    struct gparams_t *param = NULL;
+
+    if(mesh_count >= mesh_capacity)
+    {
+        mesh_capacity = mesh_capacity > 0 ? mesh_capacity * 2 : 16;
+        mesh_buffer = (struct mesh_t **)realloc(mesh_buffer, mesh_capacity * sizeof(struct mesh_t *));
+        scene.meshes = mesh_buffer;
+    }
+
+    param = (struct gparams_t *)malloc(sizeof(struct gparams_t));
+    *param = default_gparams;
+    param->name = (char *)name;
+
+    mesh_buffer[mesh_count] = (struct mesh_t *)calloc(1, sizeof(struct mesh_t));
+    mesh_buffer[mesh_count]->param = (void *)param;
+
+    return mesh_buffer[mesh_count++];
+}
+
+// Makes room for one more object, along with its material
+static struct gobject_t *
+push_object(const char *name)
+{
+    if(object_count >= object_capacity)
+    {
+        object_capacity = object_capacity > 0 ? object_capacity * 2 : 16;
+        object_bufer = (struct gobject_t *)realloc(object_bufer, object_capacity * sizeof(struct gobject_t));
+        object_gparams_buffer = (struct gparams_t *)realloc(object_gparams_buffer, object_capacity * sizeof(struct gparams_t));
+        for(int i = 0; i < object_count; i++)
+            object_bufer[i].param = (void *)&object_gparams_buffer[i];
+        scene.objects = object_bufer;
+    }
+
+    memset(&object_bufer[object_count], 0, sizeof(struct gobject_t));
+    object_gparams_buffer[object_count] = default_gparams;
+    object_gparams_buffer[object_count].name = (char *)name;
+    object_bufer[object_count].param = (void *)&object_gparams_buffer[object_count];
+
+    return &object_bufer[object_count++];
+}
+
 int
 find_mesh(char *name)
 {
     for(int i = 0; i < mesh_count; i++)
     {
-        struct gparams_t *param = (struct gparams_t *)mesh_buffer[i].triangles[0].param;
+        struct gparams_t *param = (struct gparams_t *)mesh_buffer[i]->param;
         if(strcmp(param->name, name) == 0)
             return i;
     }
@@ -289,7 +401,7 @@ find_tag(char *name)
         if(instruction->command != INSTRUCTION_TAG)
             continue;
         
-        if(strcmp(instruction->name, name))
+        if(strcmp(instruction->name, name) == 0)
             return i;
     }
 
@@ -302,7 +414,7 @@ apply_transform(char *name, matrix_t matrix)
     int i = 0;
 
     if((i = find_mesh(name)) >= 0)
-        transform_mesh(&mesh_buffer[i], matrix, &mesh_buffer[i]);
+        transform_mesh(mesh_buffer[i], matrix, mesh_buffer[i]);
 
     else if((i = find_object(name)) >= 0)
         transform_object(&object_bufer[i], matrix, &object_bufer[i]);
@@ -322,8 +434,8 @@ apply_color(char *name, struct color_t *color)
     int i = 0;
 
     if((i = find_mesh(name)) >= 0)
-        mesh_gparams_buffer[i].ac = 
-        mesh_gparams_buffer[i].dc = *color;
+        ((struct gparams_t *)mesh_buffer[i]->param)->ac = 
+        ((struct gparams_t *)mesh_buffer[i]->param)->dc = *color;
 
     else if((i = find_object(name)) >= 0)
         object_gparams_buffer[i].ac = 
@@ -339,9 +451,10 @@ void run_instruction(struct instruction_t *instruction)
     int t = 0;
     matrix_t matrix;
     struct color_t id, is, color;
-    struct framebuffer_t fb = {0};
     struct pv_t pv = PV(0.0f, 0.0f, 0.0f);
-    struct gparams_t *mesh_gparams, *object_gparams;
+    struct gobject_t *object = NULL;
+    void *param = NULL;
+    struct mesh_t *mesh = NULL;
     struct wavefront_t wf = {0};
 
     float *values[4] = {&instruction->x, &instruction->y, &instruction->z, &instruction->t};
@@ -349,9 +462,6 @@ void run_instruction(struct instruction_t *instruction)
     // And because you can never be too sure...
     char name[SCRIPT_MAX_TEXT_BUFFER + 128] = {0};
 
-    mesh_gparams = &mesh_gparams_buffer[mesh_count];
-    object_gparams = &object_gparams_buffer[mesh_count];
-
     for(size_t i = 0; i < 4; i++)
     {
         if(strlen(instruction->var[i]) > 0)
@@ -378,15 +488,8 @@ void run_instruction(struct instruction_t *instruction)
                 if(instruction->x == 0 && instruction->y == 0)
                     wrn("creating rectangle \"%s\" with empty dimensions", instruction->name);
 
-                *mesh_gparams = default_gparams;
-
-                new_rectangle_mesh_wh(instruction->x, instruction->y, &mesh_buffer[mesh_count]);
-                mesh_buffer[mesh_count].triangles[0].param = (void *)mesh_gparams;
-                mesh_buffer[mesh_count].triangles[0].param = (void *)mesh_gparams;
-
-                mesh_gparams->name = instruction->name;
-
-                mesh_count++;
+                mesh = push_mesh(instruction->name);
+                new_rectangle_mesh_wh(instruction->x, instruction->y, mesh);
             }
             
             else if(strcmp(instruction->type, "sphere") == 0)
@@ -395,14 +498,12 @@ void run_instruction(struct instruction_t *instruction)
                     wrn("creating sphere \"%s\" with no radius", instruction->name);
 
                 pv = PV(0.0f, 0.0f, 0.0f);
-                *object_gparams = default_gparams;
-
-                make_sphere(&pv, instruction->t, &object_bufer[object_count]);
-                object_bufer[object_count].param = (void *)object_gparams;
+                object = push_object(instruction->name);
+                param = object->param;
 
-                object_gparams->name = instruction->name;
-
-                object_count++;
+                // make_sphere clears param
+                make_sphere(&pv, instruction->t, object);
+                object->param = param;
             }
 
             else if(strcmp(instruction->type, "light") == 0)
@@ -434,15 +535,28 @@ void run_instruction(struct instruction_t *instruction)
         if(t < 0)
             fatal("cannot load file %s", instruction->type);
 
-        allocate_objects_from_wavefront(&wf, &mesh_buffer[mesh_count]);
+        allocate_objects_from_wavefront(&wf, push_mesh(instruction->name), instruction->t >= 1.0f, instruction->t >= 2.0f);
         wavefront_destroy(&wf);
+        break;
 
-        for(size_t i = 0; i < mesh_buffer[mesh_count].triangle_count; i++)
-            mesh_buffer[mesh_count].triangles[i].param = (void *)mesh_gparams;
+    case INSTRUCTION_INSTANCE:
+        t = find_mesh(instruction->type);
+        if(t < 0)
+            fatal("cannot find mesh \"%s\"", instruction->type);
+        if(mesh_buffer[t]->update != MESH_UPDATE_INSTANCE)
+            fatal("cannot instance mesh \"%s\", its transforms are baked into its triangles", instruction->type);
 
-        mesh_gparams->name = instruction->name;
+        mesh = push_mesh(instruction->name);
+        instance_mesh(mesh_buffer[t], mesh);
 
-        mesh_count++;
+        // Materials aren't shared, but start out the same
+        *(struct gparams_t *)mesh->param = *(struct gparams_t *)mesh_buffer[t]->param;
+        ((struct gparams_t *)mesh->param)->name = instruction->name;
+
+        inf(
+            "mesh %s was instanced from %s (%zu triangles, shared by %d meshes)",
+            instruction->name, instruction->type, mesh->data->triangle_count, mesh->data->refs
+        );
         break;
     
     case INSTRUCTION_TRANSLATE:
@@ -469,11 +583,8 @@ void run_instruction(struct instruction_t *instruction)
 
         snprintf(name, sizeof(name), "%s_%d.ppm", project_name, shot_count++);
 
-        new_framebuffer(height, width, &fb);
-        raytracer_render(&scene, &camera, &fb);
-        ppm_save(name, fb.pixels, height, width);
-
-        free_framebuffer(&fb);
+        raytracer_render(&render_context, &scene, &camera);
+        ppm_save(name, render_context.fb.pixels, height, width);
         break;
     
     case INSTRUCTION_COLOR:
@@ -481,6 +592,29 @@ void run_instruction(struct instruction_t *instruction)
         apply_color(instruction->name, &color);
         break;
 
+    case INSTRUCTION_UPDATE:
+        t = find_mesh(instruction->name);
+        if(t < 0)
+            fatal("cannot find mesh \"%s\"", instruction->name);
+        mesh = mesh_buffer[t];
+
+        if(strcmp(instruction->type, "instance") != 0 && mesh->data->refs > 1)
+            fatal("mesh \"%s\" shares its triangles with other meshes, it can only be an instance", instruction->name);
+        if(strcmp(instruction->type, "instance") != 0 && mesh->data->qvertices[0] != NULL)
+            fatal("mesh \"%s\" is compressed, it can only be an instance", instruction->name);
+
+        if(strcmp(instruction->type, "instance") == 0)
+            set_mesh_update(mesh, MESH_UPDATE_INSTANCE);
+        else if(strcmp(instruction->type, "sah") == 0)
+            set_mesh_update(mesh, MESH_UPDATE_SAH);
+        else if(strcmp(instruction->type, "lbvh") == 0)
+            set_mesh_update(mesh, MESH_UPDATE_LBVH);
+        else if(strcmp(instruction->type, "refit") == 0)
+            set_mesh_update(mesh, MESH_UPDATE_REFIT);
+        else
+            fatal("unknown update mode \"%s\" for mesh \"%s\"", instruction->type, instruction->name);
+        break;
+
     case INSTRUCTION_ASSIGN:
         t = find_variable(instruction->name);
         if(t < 0)
@@ -21,7 +21,9 @@ enum instruction_command_t
     INSTRUCTION_GOTO,
     INSTRUCTION_RENDER,
     INSTRUCTION_EXIT,
-    INSTRUCTION_COLOR
+    INSTRUCTION_COLOR,
+    INSTRUCTION_UPDATE,
+    INSTRUCTION_INSTANCE
 };
 
 struct variable_t
@@ -44,6 +46,6 @@ struct instruction_t
     float x, y, z, t;
 };
 
-void script_run_file(const char *file_name);
+void script_run_file(const char *file_name, int threads);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,13 @@
+#define _POSIX_C_SOURCE 200809L
+#include "utilities.h"
+
+// Monotonic, so the clock being set while something runs
+// doesn't mess up how long it took
+double
+time_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
 #ifdef __GNUC__
 #define INLINE                                                  __attribute__((always_inline))
@@ -26,6 +27,9 @@
 #define SWAP(X, Y, T)                                           do { T s = X; X = Y; Y = s; } while(0)
 #define UNUSED(x)                                               ((void)(x))
 
+// Milliseconds since some arbitrary point in time. Only good
+// to measure how long something took
+double time_ms(void);
 
 #define DYNAMIC_ARRAY(NAME, T)                                  \
     typedef struct NAME {                                       \
@@ -0,0 +1,365 @@
+#ifndef VECMATH_H__
+#define VECMATH_H__
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// Vector and matrix math for struct pv_t and matrix_t. Everything
+// in here gets inlined into whoever uses it, so the raytracer's hot
+// loops don't make a call for every little add. Vectors live in
+// SSE registers on x86 (unless built with VECMATH_NO_SIMD), and in
+// a plain struct pv_t everywhere else. Both do the exact same math
+// in the exact same order, so they give the same results
+#if !defined(VECMATH_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECMATH_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define VECMATH_INLINE              static inline __attribute__((always_inline))
+#else
+#define VECMATH_INLINE              static inline
+#endif
+
+typedef float matrix_t[4][4];
+typedef float column_t[4][1];
+
+struct pv_t
+{ float x,y,z,w; };
+
+#ifdef VECMATH_X86_SIMD
+typedef __m128 vec_t;
+#else
+typedef struct pv_t vec_t;
+#endif
+
+VECMATH_INLINE vec_t
+vec_set(float x, float y, float z, float w)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_setr_ps(x, y, z, w);
+#else
+    return (vec_t){x, y, z, w};
+#endif
+}
+
+VECMATH_INLINE vec_t
+vec_load(const struct pv_t *p)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_loadu_ps(&p->x);
+#else
+    return *p;
+#endif
+}
+
+VECMATH_INLINE void
+vec_store(struct pv_t *p, vec_t v)
+{
+#ifdef VECMATH_X86_SIMD
+    _mm_storeu_ps(&p->x, v);
+#else
+    *p = v;
+#endif
+}
+
+// Stores x, y and z, and leaves whatever w p had
+VECMATH_INLINE void
+vec_store3(struct pv_t *p, vec_t v)
+{
+#ifdef VECMATH_X86_SIMD
+    _mm_storel_pi((__m64 *)&p->x, v);
+    _mm_store_ss(&p->z, _mm_movehl_ps(v, v));
+#else
+    p->x = v.x;
+    p->y = v.y;
+    p->z = v.z;
+#endif
+}
+
+// v with a w of 0
+VECMATH_INLINE vec_t
+vec_xyz(vec_t v)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_and_ps(v, _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0)));
+#else
+    v.w = 0.0f;
+    return v;
+#endif
+}
+
+VECMATH_INLINE vec_t
+vec_add(vec_t a, vec_t b)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_add_ps(a, b);
+#else
+    return (vec_t){a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w};
+#endif
+}
+
+VECMATH_INLINE vec_t
+vec_sub(vec_t a, vec_t b)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_sub_ps(a, b);
+#else
+    return (vec_t){a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w};
+#endif
+}
+
+VECMATH_INLINE vec_t
+vec_mul(vec_t a, vec_t b)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_mul_ps(a, b);
+#else
+    return (vec_t){a.x * b.x, a.y * b.y, a.z * b.z, a.w * b.w};
+#endif
+}
+
+VECMATH_INLINE vec_t
+vec_scale(vec_t v, float s)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_mul_ps(v, _mm_set1_ps(s));
+#else
+    return (vec_t){v.x * s, v.y * s, v.z * s, v.w * s};
+#endif
+}
+
+// Divides every component by s (for real, not times 1/s)
+VECMATH_INLINE vec_t
+vec_div(vec_t v, float s)
+{
+#ifdef VECMATH_X86_SIMD
+    return _mm_div_ps(v, _mm_set1_ps(s));
+#else
+    return (vec_t){v.x / s, v.y / s, v.z / s, v.w / s};
+#endif
+}
+
+// Dot product of x, y and z, added up in that order
+VECMATH_INLINE float
+vec_dot3(vec_t a, vec_t b)
+{
+#ifdef VECMATH_X86_SIMD
+    __m128 p = _mm_mul_ps(a, b), s;
+
+    s = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    s = _mm_add_ss(s, _mm_movehl_ps(p, p));
+    return _mm_cvtss_f32(s);
+#else
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+#endif
+}
+
+// Cross product of x, y and z. w ends up as garbage
+VECMATH_INLINE vec_t
+vec_cross(vec_t a, vec_t b)
+{
+#ifdef VECMATH_X86_SIMD
+    __m128 a_yzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 b_yzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 a_zxy = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    __m128 b_zxy = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+
+    return _mm_sub_ps(_mm_mul_ps(a_yzx, b_zxy), _mm_mul_ps(a_zxy, b_yzx));
+#else
+    return (vec_t){
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x,
+        0.0f
+    };
+#endif
+}
+
+VECMATH_INLINE float
+vec_length(vec_t v)
+{
+    return sqrtf(vec_dot3(v, v));
+}
+
+// Columns of m, so transforms don't have to go row by row
+VECMATH_INLINE void
+vec_matrix_columns(matrix_t m, vec_t c[4])
+{
+#ifdef VECMATH_X86_SIMD
+    c[0] = _mm_loadu_ps(m[0]);
+    c[1] = _mm_loadu_ps(m[1]);
+    c[2] = _mm_loadu_ps(m[2]);
+    c[3] = _mm_loadu_ps(m[3]);
+    _MM_TRANSPOSE4_PS(c[0], c[1], c[2], c[3]);
+#else
+    for(int i = 0; i < 4; i++)
+        c[i] = (vec_t){m[0][i], m[1][i], m[2][i], m[3][i]};
+#endif
+}
+
+// m * p, with m given by its columns (see vec_matrix_columns)
+VECMATH_INLINE vec_t
+vec_transform_columns(const vec_t c[4], vec_t p)
+{
+#ifdef VECMATH_X86_SIMD
+    __m128 r;
+
+    r = _mm_mul_ps(c[0], _mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)));
+    r = _mm_add_ps(r, _mm_mul_ps(c[1], _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))));
+    r = _mm_add_ps(r, _mm_mul_ps(c[2], _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2))));
+    r = _mm_add_ps(r, _mm_mul_ps(c[3], _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3))));
+    return r;
+#else
+    return (vec_t){
+        c[0].x * p.x + c[1].x * p.y + c[2].x * p.z + c[3].x * p.w,
+        c[0].y * p.x + c[1].y * p.y + c[2].y * p.z + c[3].y * p.w,
+        c[0].z * p.x + c[1].z * p.y + c[2].z * p.z + c[3].z * p.w,
+        c[0].w * p.x + c[1].w * p.y + c[2].w * p.z + c[3].w * p.w
+    };
+#endif
+}
+
+// m * p
+VECMATH_INLINE vec_t
+vec_transform(matrix_t m, vec_t p)
+{
+    vec_t c[4];
+
+    vec_matrix_columns(m, c);
+    return vec_transform_columns(c, p);
+}
+
+// r = m * c. r can be m or c too
+VECMATH_INLINE void
+vec_matrix_multiply(matrix_t m, matrix_t c, matrix_t r)
+{
+#ifdef VECMATH_X86_SIMD
+    __m128 rows[4], a[4];
+
+    for(int i = 0; i < 4; i++)
+    {
+        rows[i] = _mm_loadu_ps(c[i]);
+        a[i] = _mm_loadu_ps(m[i]);
+    }
+
+    for(int i = 0; i < 4; i++)
+    {
+        __m128 s;
+
+        s = _mm_mul_ps(_mm_shuffle_ps(a[i], a[i], _MM_SHUFFLE(0, 0, 0, 0)), rows[0]);
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_shuffle_ps(a[i], a[i], _MM_SHUFFLE(1, 1, 1, 1)), rows[1]));
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_shuffle_ps(a[i], a[i], _MM_SHUFFLE(2, 2, 2, 2)), rows[2]));
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_shuffle_ps(a[i], a[i], _MM_SHUFFLE(3, 3, 3, 3)), rows[3]));
+        _mm_storeu_ps(r[i], s);
+    }
+#else
+    matrix_t t;
+
+    for(int i = 0; i < 4; i++)
+        for(int j = 0; j < 4; j++)
+            t[i][j] = m[i][0] * c[0][j] + m[i][1] * c[1][j] + m[i][2] * c[2][j] + m[i][3] * c[3][j];
+    memcpy(r, t, sizeof(t));
+#endif
+}
+
+// The pointer based API the rest of heist was written against. It
+// used to live on geometry.c, and keeps its quirks: add and substract
+// clear w, while scale, multiply, normalize and cross leave r's alone
+
+// r = a - b
+VECMATH_INLINE void
+substract_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
+{
+    vec_store(r, vec_xyz(vec_sub(vec_load(a), vec_load(b))));
+}
+
+// r = a + b
+VECMATH_INLINE void
+add_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
+{
+    vec_store(r, vec_xyz(vec_add(vec_load(a), vec_load(b))));
+}
+
+// r = p * s
+VECMATH_INLINE void
+scale_pv(struct pv_t *p, float s, struct pv_t *r)
+{
+    vec_store3(r, vec_scale(vec_load(p), s));
+}
+
+// r = p / s
+VECMATH_INLINE void
+divide_pv(struct pv_t *p, float s, struct pv_t *r)
+{
+    scale_pv(p, 1.0/s, r);
+}
+
+// r = a * b
+VECMATH_INLINE void
+multiply_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
+{
+    vec_store3(r, vec_mul(vec_load(a), vec_load(b)));
+}
+
+// Returns ||v||
+VECMATH_INLINE float
+magnitude_pv(struct pv_t *v)
+{
+    return vec_length(vec_load(v));
+}
+
+// r = v/(||v||)
+VECMATH_INLINE void
+normalize_pv(struct pv_t *v, struct pv_t *r)
+{
+    vec_t a = vec_load(v);
+
+    vec_store3(r, vec_div(a, vec_length(a)));
+}
+
+VECMATH_INLINE float
+dot_product(struct pv_t *a, struct pv_t *b)
+{
+    return vec_dot3(vec_load(a), vec_load(b));
+}
+
+VECMATH_INLINE void
+cross_pv(struct pv_t *a, struct pv_t *b, struct pv_t *r)
+{
+    vec_store3(r, vec_cross(vec_load(a), vec_load(b)));
+}
+
+// Reflects i around normal n
+VECMATH_INLINE void
+reflect_pv(struct pv_t *i, struct pv_t *n, struct pv_t *r)
+{
+    struct pv_t p = {0.0};
+
+    scale_pv(n, dot_product(i, n) * 2.0, &p);
+    substract_pv(i, &p, r);
+}
+
+// r = m * c
+VECMATH_INLINE void
+mxc(matrix_t m, column_t c, column_t r)
+{
+    vec_store((struct pv_t *)r, vec_transform(m, vec_load((struct pv_t *)c)));
+}
+
+// r = m * c
+VECMATH_INLINE void
+mxm(matrix_t m, matrix_t c, matrix_t r)
+{
+    vec_matrix_multiply(m, c, r);
+}
+
+// Apply transform matrix m to pv
+VECMATH_INLINE void
+transform_pv(matrix_t m, struct pv_t *p, struct pv_t *r)
+{
+    vec_store(r, vec_transform(m, vec_load(p)));
+}
+
+#endif
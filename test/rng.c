@@ -0,0 +1,109 @@
+// rng_hash test. Everything random in the raytracer comes out of
+// rng_hash(key, counter), with keys that are often right next to each
+// other (seeds of neighbouring pixels, dimensions of the sampler), so
+// the streams of nearby keys can't end up being the same numbers
+//
+// Usage: test_rng
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fmath.h"
+
+#define TEST_KEYS                   1024
+#define TEST_COUNTERS               1024
+
+// What's xored into the key by a counter step of the old hash
+#define OLD_STEP                    0x9e3779b9u
+
+static int
+compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+// Same numbers on the first TEST_COUNTERS of every two of the first
+// TEST_KEYS keys. There's 2^20 of them on 32 bits, so chance alone
+// gives about n^2/2^33 = 128 of those
+static bool
+test_duplicates(void)
+{
+    size_t n = TEST_KEYS * TEST_COUNTERS, duplicates = 0;
+    uint32_t *h = (uint32_t *)malloc(n * sizeof(uint32_t));
+    double expected = (double)n * n / 8589934592.0;
+
+    for(uint32_t k = 0; k < TEST_KEYS; k++)
+        for(uint32_t c = 0; c < TEST_COUNTERS; c++)
+            h[k * TEST_COUNTERS + c] = rng_hash(k, c);
+
+    qsort(h, n, sizeof(uint32_t), compare_u32);
+    for(size_t i = 1; i < n; i++)
+        duplicates += h[i] == h[i - 1];
+    free(h);
+
+    inf("duplicates: %zu (chance gives %.0f)", duplicates, expected);
+    if(duplicates > 2 * expected)
+    {
+        err("nearby keys share way too many numbers");
+        return false;
+    }
+
+    return true;
+}
+
+// The old hash only ever saw key ^ counter * OLD_STEP, so key k at
+// counter c was the same as key k ^ (c ^ d) * OLD_STEP at counter d
+static bool
+test_xor_pairs(void)
+{
+    size_t same = 0;
+
+    for(uint32_t k = 0; k < TEST_KEYS; k++)
+        for(uint32_t c = 0; c < TEST_COUNTERS; c++)
+            same += rng_hash(k, c) == rng_hash(k ^ (c * OLD_STEP) ^ ((c + 1) * OLD_STEP), c + 1);
+
+    inf("xor pairs that collide: %zu", same);
+    if(same > 1)
+    {
+        err("keys and counters aren't mixed separately");
+        return false;
+    }
+
+    return true;
+}
+
+// Streams of keys k and k + 1 should differ on about half the bits
+static bool
+test_neighbours(void)
+{
+    double bits = 0.0, n = (double)TEST_KEYS * TEST_COUNTERS;
+
+    for(uint32_t k = 0; k < TEST_KEYS; k++)
+        for(uint32_t c = 0; c < TEST_COUNTERS; c++)
+            bits += __builtin_popcount(rng_hash(k, c) ^ rng_hash(k + 1, c));
+
+    inf("bits that differ between neighbouring keys: %.3f of 32", bits/n);
+    if(fabs(bits/n - 16.0) > 0.05)
+    {
+        err("neighbouring keys give related streams");
+        return false;
+    }
+
+    return true;
+}
+
+int
+main(int argc, char const *argv[])
+{
+    bool ok = true;
+
+    ok &= test_duplicates();
+    ok &= test_xor_pairs();
+    ok &= test_neighbours();
+
+    return ok ? 0 : 1;
+}